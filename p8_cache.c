@@ -0,0 +1,510 @@
+/*
+
+	p8_cache: remembers code section compress / decompress results
+
+	results are looked up by a 128-bit hash of the input plus operation, codec, level and search
+	limits, so repeat calls on the same bytes (re-saves, thumbnails, validation) are a hash, a
+	compare and a copy. the input is stored with each result and compared on lookup: the hash
+	only narrows down, so inputs made to collide just miss.
+
+	kept in an in-memory LRU (max_bytes of inputs + results), and optionally in a store file that
+	is memory mapped and survives restarts. the store is fixed size: once full, new results only
+	go to the LRU. a store file that doesn't check out is emptied. build with -DPXA_THREADS to
+	share one cache between threads.
+
+	license: same as pxa_compress_snippets.c (MIT)
+
+*/
+
+#include "p8_common.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef PXA_THREADS
+#include <pthread.h>
+#endif
+
+#define P8_CACHE_DECOMPRESS 4 // op for decompress results (compress: codec, P8_CACHE_MINI..P8_CACHE_AUTO)
+
+// what else a result depends on: op / codec, level (or max_len), search limit overrides
+#define P8_CACHE_PARAMS 4
+
+#define P8_CACHE_MAGIC "p8cache2"
+#define P8_CACHE_HEADER 64
+#define P8_CACHE_RECORD ((6 + P8_CACHE_PARAMS) * 8) // record header: before input and result
+
+//-------------------------------------------------
+// hash: two 64-bit lanes, 8 bytes per step
+//-------------------------------------------------
+
+#define ROTL64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+static uint64 p8_mix64(uint64 h)
+{
+	h ^= h >> 33; h *= 0xff51afd7ed558ccdull;
+	h ^= h >> 33; h *= 0xc4ceb9fe1a85ec53ull;
+	h ^= h >> 33;
+	return h;
+}
+
+static void p8_hash128(uint8 *dat, int len, uint64 seed, uint64 *h)
+{
+	uint64 a = seed ^ 0x9e3779b97f4a7c15ull;
+	uint64 b = seed + (uint64)len * 0x87c37b91114253d5ull;
+	uint64 v;
+	int i;
+
+	for (i = 0; i + 8 <= len; i += 8)
+	{
+		memcpy(&v, dat + i, 8);
+		a = ROTL64(a ^ (v * 0x87c37b91114253d5ull), 31) * 0x4cf5ad432745937full;
+		b = ROTL64(b + v, 27) * 0x52dce729ull + a;
+	}
+
+	v = 0;
+	memcpy(&v, dat + i, len - i);
+	a = ROTL64(a ^ (v * 0x87c37b91114253d5ull), 31) * 0x4cf5ad432745937full;
+	b = ROTL64(b + v, 27) * 0x52dce729ull + a;
+
+	h[0] = p8_mix64(a ^ b);
+	h[1] = p8_mix64(b + h[0]);
+}
+
+static void p8_cache_key(uint8 *in_p, int len, int *param, uint64 *key)
+{
+	uint64 seed = 0;
+	int i;
+
+	for (i = 0; i < P8_CACHE_PARAMS; i++)
+		seed = p8_mix64(seed ^ (unsigned)param[i]);
+
+	p8_hash128(in_p, len, seed, key);
+}
+
+//-------------------------------------------------
+// cache
+//-------------------------------------------------
+
+typedef struct p8_cache_entry
+{
+	uint64 key[2];
+	int param[P8_CACHE_PARAMS];
+	int in_len, len, format;
+	uint8 *input;        // in_len bytes, then result: len bytes at data
+	uint8 *data;
+	int in_store;        // in store mapping (else own allocation of input + result)
+	struct p8_cache_entry *hash_next;
+	struct p8_cache_entry *lru_prev, *lru_next; // LRU entries only: most recent first
+} p8_cache_entry;
+
+struct p8_cache
+{
+	p8_cache_entry **bucket;
+	int num_buckets, num_entries;
+
+	p8_cache_entry *lru_first, *lru_last;
+	int lru_bytes, max_bytes;
+
+	// store file: header (magic, size, used) then records (see p8_cache_put), 8-byte aligned
+	uint8 *store;
+	int store_size, store_fd;
+
+	int hits, misses;
+
+#ifdef PXA_THREADS
+	pthread_mutex_t lock;
+#endif
+};
+
+static p8_cache_entry *p8_cache_find(p8_cache *c, uint64 *key, int *param, uint8 *in_p, int in_len)
+{
+	p8_cache_entry *e = c->bucket[key[0] & (c->num_buckets - 1)];
+
+	for (; e; e = e->hash_next)
+		if (e->key[0] == key[0] && e->key[1] == key[1] && e->in_len == in_len &&
+			!memcmp(e->param, param, sizeof(e->param)) && !memcmp(e->input, in_p, in_len))
+			return e;
+
+	return NULL;
+}
+
+static void p8_cache_unlink_hash(p8_cache *c, p8_cache_entry *e)
+{
+	p8_cache_entry **p = &c->bucket[e->key[0] & (c->num_buckets - 1)];
+
+	while (*p != e)
+		p = &(*p)->hash_next;
+	*p = e->hash_next;
+	c->num_entries --;
+}
+
+static void p8_cache_unlink_lru(p8_cache *c, p8_cache_entry *e)
+{
+	if (e->lru_prev) e->lru_prev->lru_next = e->lru_next; else c->lru_first = e->lru_next;
+	if (e->lru_next) e->lru_next->lru_prev = e->lru_prev; else c->lru_last = e->lru_prev;
+}
+
+static void p8_cache_push_lru(p8_cache *c, p8_cache_entry *e)
+{
+	e->lru_prev = NULL;
+	e->lru_next = c->lru_first;
+	if (c->lru_first) c->lru_first->lru_prev = e; else c->lru_last = e;
+	c->lru_first = e;
+}
+
+static void p8_cache_add_entry(p8_cache *c, p8_cache_entry *e)
+{
+	int i;
+
+	// grow at load factor 1
+	if (c->num_entries >= c->num_buckets)
+	{
+		p8_cache_entry **old = c->bucket;
+		int old_num = c->num_buckets;
+
+		c->num_buckets *= 2;
+		c->bucket = codo_malloc(c->num_buckets * sizeof(p8_cache_entry *));
+		memset(c->bucket, 0, c->num_buckets * sizeof(p8_cache_entry *));
+
+		for (i = 0; i < old_num; i++)
+			while (old[i])
+			{
+				p8_cache_entry *next = old[i]->hash_next;
+				int b = old[i]->key[0] & (c->num_buckets - 1);
+				old[i]->hash_next = c->bucket[b];
+				c->bucket[b] = old[i];
+				old[i] = next;
+			}
+
+		codo_free(old);
+	}
+
+	e->hash_next = c->bucket[e->key[0] & (c->num_buckets - 1)];
+	c->bucket[e->key[0] & (c->num_buckets - 1)] = e;
+	c->num_entries ++;
+}
+
+static uint64 p8_store_get(uint8 *p) { uint64 v; memcpy(&v, p, 8); return v; }
+static void p8_store_set(uint8 *p, uint64 v) { memcpy(p, &v, 8); }
+
+// record: key[2], param[P8_CACHE_PARAMS], in_len, len, format, 0 (8 bytes each), then input,
+// then result, padded to 8 bytes
+#define P8_RECORD_IN_LEN(r) p8_store_get((r) + 16 + P8_CACHE_PARAMS * 8)
+#define P8_RECORD_LEN(r)    p8_store_get((r) + 24 + P8_CACHE_PARAMS * 8)
+#define P8_RECORD_FORMAT(r) p8_store_get((r) + 32 + P8_CACHE_PARAMS * 8)
+
+static uint64 p8_record_size(uint64 in_len, uint64 len)
+{
+	return P8_CACHE_RECORD + ((in_len + len + 7) & ~7ull);
+}
+
+// store file is untrusted: 1 if records exactly cover header..used, each inside it
+static int p8_cache_check_store(p8_cache *c)
+{
+	uint64 used = p8_store_get(c->store + 16);
+	uint64 pos, in_len, len;
+
+	if (memcmp(c->store, P8_CACHE_MAGIC, 8) || p8_store_get(c->store + 8) != c->store_size) return 0;
+	if (used < P8_CACHE_HEADER || used > c->store_size) return 0;
+
+	for (pos = P8_CACHE_HEADER; pos < used; pos += p8_record_size(in_len, len))
+	{
+		if (used - pos < P8_CACHE_RECORD) return 0;
+
+		in_len = P8_RECORD_IN_LEN(c->store + pos);
+		len    = P8_RECORD_LEN(c->store + pos);
+		if (in_len > used || len > used || p8_record_size(in_len, len) > used - pos) return 0;
+	}
+
+	return 1;
+}
+
+// map store file (created at store_size bytes if missing), and index its records
+static void p8_cache_open_store(p8_cache *c, char *fn, int store_size)
+{
+	struct stat sb;
+	int fd = open(fn, O_RDWR | O_CREAT, 0644);
+	int pos, used, i;
+
+	if (fd < 0) return;
+
+	if (fstat(fd, &sb) || sb.st_size < P8_CACHE_HEADER)
+	{
+		if (ftruncate(fd, store_size)) { close(fd); return; }
+		sb.st_size = store_size;
+	}
+
+	if (sb.st_size > 0x7fffffff) { close(fd); return; }
+
+	c->store = mmap(NULL, sb.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (c->store == MAP_FAILED) { c->store = NULL; close(fd); return; }
+
+	c->store_fd = fd;
+	c->store_size = sb.st_size;
+
+	if (!p8_cache_check_store(c))
+	{
+		// new (or not a valid store): start empty
+		memset(c->store, 0, P8_CACHE_HEADER);
+		memcpy(c->store, P8_CACHE_MAGIC, 8);
+		p8_store_set(c->store + 8, c->store_size);
+		p8_store_set(c->store + 16, P8_CACHE_HEADER);
+		return;
+	}
+
+	used = p8_store_get(c->store + 16);
+	for (pos = P8_CACHE_HEADER; pos < used; pos += p8_record_size(P8_RECORD_IN_LEN(c->store + pos), P8_RECORD_LEN(c->store + pos)))
+	{
+		p8_cache_entry *e = codo_malloc(sizeof(p8_cache_entry));
+		uint8 *r = c->store + pos;
+
+		e->key[0] = p8_store_get(r);
+		e->key[1] = p8_store_get(r + 8);
+		for (i = 0; i < P8_CACHE_PARAMS; i++)
+			e->param[i] = p8_store_get(r + 16 + i * 8);
+		e->in_len = P8_RECORD_IN_LEN(r);
+		e->len    = P8_RECORD_LEN(r);
+		e->format = P8_RECORD_FORMAT(r);
+		e->input  = r + P8_CACHE_RECORD;
+		e->data   = e->input + e->in_len;
+		e->in_store = 1;
+		p8_cache_add_entry(c, e);
+	}
+}
+
+// max_bytes: LRU size. store_fn: store file (NULL for none), created at store_size bytes
+p8_cache *p8_cache_create(int max_bytes, char *store_fn, int store_size)
+{
+	p8_cache *c = codo_malloc(sizeof(p8_cache));
+
+	memset(c, 0, sizeof(p8_cache));
+	c->max_bytes = max_bytes;
+	c->num_buckets = 1024;
+	c->bucket = codo_malloc(c->num_buckets * sizeof(p8_cache_entry *));
+	memset(c->bucket, 0, c->num_buckets * sizeof(p8_cache_entry *));
+	c->store_fd = -1;
+
+#ifdef PXA_THREADS
+	pthread_mutex_init(&c->lock, NULL);
+#endif
+
+	if (store_fn)
+		p8_cache_open_store(c, store_fn, MAX(store_size, P8_CACHE_HEADER));
+
+	return c;
+}
+
+void p8_cache_free(p8_cache *c)
+{
+	int i;
+
+	if (!c) return;
+
+	for (i = 0; i < c->num_buckets; i++)
+		while (c->bucket[i])
+		{
+			p8_cache_entry *next = c->bucket[i]->hash_next;
+			if (!c->bucket[i]->in_store) codo_free(c->bucket[i]->input);
+			codo_free(c->bucket[i]);
+			c->bucket[i] = next;
+		}
+
+	if (c->store)
+	{
+		msync(c->store, c->store_size, MS_SYNC);
+		munmap(c->store, c->store_size);
+		close(c->store_fd);
+	}
+
+#ifdef PXA_THREADS
+	pthread_mutex_destroy(&c->lock);
+#endif
+
+	codo_free(c->bucket);
+	codo_free(c);
+}
+
+// copy result to out (and its format). returns length, or -1 if not cached
+static int p8_cache_get(p8_cache *c, uint64 *key, int *param, uint8 *in_p, int in_len, uint8 *out, int *format)
+{
+	p8_cache_entry *e;
+	int len = -1;
+
+#ifdef PXA_THREADS
+	pthread_mutex_lock(&c->lock);
+#endif
+
+	if ((e = p8_cache_find(c, key, param, in_p, in_len)))
+	{
+		if (!e->in_store)
+		{
+			p8_cache_unlink_lru(c, e);
+			p8_cache_push_lru(c, e);
+		}
+		memcpy(out, e->data, e->len);
+		len = e->len;
+		*format = e->format;
+		c->hits ++;
+	}
+	else
+		c->misses ++;
+
+#ifdef PXA_THREADS
+	pthread_mutex_unlock(&c->lock);
+#endif
+
+	return len;
+}
+
+static void p8_cache_put(p8_cache *c, uint64 *key, int *param, uint8 *in_p, int in_len, uint8 *dat, int len, int format)
+{
+	p8_cache_entry *e;
+	int used, size, i;
+
+#ifdef PXA_THREADS
+	pthread_mutex_lock(&c->lock);
+#endif
+
+	if (p8_cache_find(c, key, param, in_p, in_len)) goto done; // added by another thread meanwhile
+
+	e = codo_malloc(sizeof(p8_cache_entry));
+	e->key[0] = key[0];
+	e->key[1] = key[1];
+	memcpy(e->param, param, sizeof(e->param));
+	e->in_len = in_len;
+	e->len = len;
+	e->format = format;
+
+	used = c->store ? p8_store_get(c->store + 16) : 0;
+	size = p8_record_size(in_len, len);
+	if (c->store && size <= c->store_size - used)
+	{
+		// append record, then publish it by moving used past it
+		uint8 *r = c->store + used;
+
+		p8_store_set(r, key[0]);
+		p8_store_set(r + 8, key[1]);
+		for (i = 0; i < P8_CACHE_PARAMS; i++)
+			p8_store_set(r + 16 + i * 8, param[i]);
+		p8_store_set(r + 16 + P8_CACHE_PARAMS * 8, in_len);
+		p8_store_set(r + 24 + P8_CACHE_PARAMS * 8, len);
+		p8_store_set(r + 32 + P8_CACHE_PARAMS * 8, format);
+		p8_store_set(r + 40 + P8_CACHE_PARAMS * 8, 0);
+		memcpy(r + P8_CACHE_RECORD, in_p, in_len);
+		memcpy(r + P8_CACHE_RECORD + in_len, dat, len);
+		p8_store_set(c->store + 16, used + size);
+
+		e->input = r + P8_CACHE_RECORD;
+		e->in_store = 1;
+	}
+	else
+	{
+		if (in_len + len > c->max_bytes) { codo_free(e); goto done; }
+
+		// make room: drop least recently used
+		while (c->lru_bytes + in_len + len > c->max_bytes && c->lru_last)
+		{
+			p8_cache_entry *old = c->lru_last;
+			p8_cache_unlink_lru(c, old);
+			p8_cache_unlink_hash(c, old);
+			c->lru_bytes -= old->in_len + old->len;
+			codo_free(old->input);
+			codo_free(old);
+		}
+
+		e->input = codo_malloc(MAX(in_len + len, 1));
+		memcpy(e->input, in_p, in_len);
+		memcpy(e->input + in_len, dat, len);
+		e->in_store = 0;
+		c->lru_bytes += in_len + len;
+		p8_cache_push_lru(c, e);
+	}
+
+	e->data = e->input + in_len;
+	p8_cache_add_entry(c, e);
+
+done:
+#ifdef PXA_THREADS
+	pthread_mutex_unlock(&c->lock);
+#endif
+	return;
+}
+
+// same result as compress_mini / pxa_compress / pico8_code_section_compress (codec), but
+// looked up when the same input was compressed before with the same codec, level and search
+// limits. out: 0x30000 bytes (or CODE_SECTION_SIZE for P8_CACHE_AUTO, zero padded on return).
+// format (can be NULL): as pico8_code_section_compress. ctx: one per thread (its :c: context
+// is used for P8_CACHE_MINI)
+int p8_cache_compress(p8_cache *c, pxa_context *ctx, int codec, uint8 *in_p, uint8 *out, int len, int level, int *format)
+{
+	uint64 key[2];
+	int param[P8_CACHE_PARAMS] = {codec, codec == P8_CACHE_MINI ? 0 : level, 0, 0};
+	int out_len, out_format = 0;
+
+	if (codec != P8_CACHE_MINI)
+		pxa_get_search_limits(ctx, &param[2], &param[3]);
+
+	p8_cache_key(in_p, len, param, key);
+
+	if ((out_len = p8_cache_get(c, key, param, in_p, len, out, &out_format)) < 0)
+	{
+		if (codec == P8_CACHE_MINI)
+		{
+			out_len = compress_mini(pxa_mini_context(ctx), in_p, out, len, NULL);
+		}
+		else if (codec == P8_CACHE_PXA)
+			out_len = pxa_compress(ctx, in_p, out, len, level, NULL);
+		else
+			out_len = pico8_code_section_compress(ctx, in_p, out, len, level, &out_format);
+
+		// mini / pxa encoders return input as is when compressing doesn't help
+		if (codec != P8_CACHE_AUTO && out_len >= 8)
+			out_format = is_compressed_format_header(out);
+
+		if (out_len >= 0)
+			p8_cache_put(c, key, param, in_p, len, out, out_len, out_format);
+	}
+
+	// whole section, as on a miss
+	if (codec == P8_CACHE_AUTO && out_len >= 0 && out_len < CODE_SECTION_SIZE)
+		memset(out + out_len, 0, CODE_SECTION_SIZE - out_len);
+
+	if (format) *format = out_format;
+	return out_len;
+}
+
+// same result as pico8_code_section_decompress_safe (including null terminator), but looked up
+// when the same data was decompressed before with the same max_len. corrupt data isn't cached
+int p8_cache_decompress(p8_cache *c, pxa_context *ctx, uint8 *in_p, int in_len, uint8 *out_p, int max_len)
+{
+	uint64 key[2];
+	int param[P8_CACHE_PARAMS] = {P8_CACHE_DECOMPRESS, max_len, 0, 0};
+	int out_len, format;
+
+	p8_cache_key(in_p, in_len, param, key);
+
+	if ((out_len = p8_cache_get(c, key, param, in_p, in_len, out_p, &format)) >= 0)
+	{
+		out_p[out_len] = 0;
+		return out_len;
+	}
+
+	out_len = pico8_code_section_decompress_safe(ctx, in_p, in_len, out_p, max_len);
+
+	if (out_len >= 0)
+		p8_cache_put(c, key, param, in_p, in_len, out_p, out_len, 0);
+
+	return out_len;
+}
+
+// lookups that found a result / had to run the codec
+void p8_cache_stats(p8_cache *c, int *hits, int *misses)
+{
+	*hits = c->hits;
+	*misses = c->misses;
+}
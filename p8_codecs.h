@@ -0,0 +1,184 @@
+/*
+
+	p8_codecs.h: functions and constants for callers of the code section codecs
+	(p8_compress.c, pxa_compress_snippets.c) and the files built on them (p8png.c, p8_cache.c)
+
+*/
+
+#ifndef P8_CODECS_H
+#define P8_CODECS_H
+
+typedef unsigned char uint8;
+typedef unsigned long long uint64;
+
+#define CODE_SECTION_SIZE 0x3d00 // bytes at 0x4300 in cart rom
+#define CODE_MAX_LEN      0xffff // longest code encoders take (16-bit length in both headers)
+
+// pxa_compress levels
+#define PXA_LEVEL_FAST    0 // no lookahead, only try most recent PXA_FAST_MAX_CHAIN matches (live previews)
+#define PXA_LEVEL_DEFAULT 1 // same output as 0.2.4c (no search limits: slow on long runs of similar data)
+#define PXA_LEVEL_MAX     2 // optimal parse over exact bit costs (see pxa_parse_window)
+
+// streaming decoders (decompress_mini_stream, pxa_decompress_stream) return
+#define CODE_STREAM_END     0  // finished: all output written
+#define CODE_STREAM_INPUT   1  // used up avail_in; call again with more input
+#define CODE_STREAM_OUTPUT  2  // avail_out is full; call again with more space
+#define CODE_STREAM_ERROR  -1  // corrupt data
+
+// p8_cache_compress codecs
+#define P8_CACHE_MINI 1 // compress_mini
+#define P8_CACHE_PXA  2 // pxa_compress
+#define P8_CACHE_AUTO 3 // pico8_code_section_compress
+
+// P8PNG image and cart data
+#define P8PNG_WIDTH 160
+#define P8PNG_HEIGHT 205
+#define P8PNG_DATA_SIZE (P8PNG_WIDTH * P8PNG_HEIGHT) // rom + version info: 32800 bytes
+#define P8PNG_ROM_SIZE 0x8000
+#define P8PNG_CODE_OFFSET 0x4300
+#define P8PNG_CODE_SIZE (P8PNG_ROM_SIZE - P8PNG_CODE_OFFSET) // 0x3d00
+
+typedef struct mini_context mini_context;
+typedef struct mini_stats mini_stats;
+typedef struct pxa_context pxa_context;
+typedef struct pxa_stats pxa_stats;
+typedef struct pxa_incremental pxa_incremental;
+typedef struct pxa_index pxa_index;
+typedef struct mini_stream mini_stream;
+typedef struct pxa_stream pxa_stream;
+typedef struct p8_cache p8_cache;
+
+// optional per-call stats: pass to compress_mini (or NULL)
+struct mini_stats
+{
+	int literal_bits;      // 8 per literal, 16 for rare literals (not in literal string)
+	int block_bits;        // 16 per block
+	int num_literals, num_rare_literals, num_blocks;
+	int stored_raw;        // compressed was larger than input: output is input
+
+	int len_hist[18];      // [len]: blocks of length len (3..17)
+	int offset_hist[12];   // [i]: blocks with offset 2^i .. 2^(i+1)-1
+
+	// seconds
+	double search_time;    // find_repeatable_block (includes building hash chains)
+	double emit_time;      // everything else
+};
+
+// optional per-call encoder stats: pass to pxa_compress (or NULL). counts are for the
+// final output, so tokens that were rewritten as a raw block are not included.
+#define PXA_STATS_HIST 16
+
+struct pxa_stats
+{
+	int literal_bits;  // including 1-bit type marker
+	int block_bits;
+	int raw_bits;      // raw block headers, data and terminators
+	int num_literals, num_blocks;
+	int raw_rewrites;  // segments rewritten as raw (counting ones later undone)
+	int stored_raw;    // compressed was larger than input: output is input
+
+	int len_hist[PXA_STATS_HIST];    // [i]: blocks with length 2^i .. 2^(i+1)-1
+	int offset_hist[PXA_STATS_HIST]; // [i]: blocks with offset 2^i .. 2^(i+1)-1
+
+	// seconds
+	double hash_time;    // pxa_build_hash_lookup
+	double search_time;  // finding matches / choosing literal or block (optimal parse for max level)
+	double emit_time;    // everything else: writing bits, raw block checks
+};
+
+// streaming decoder state (see decompress_mini_stream, pxa_decompress_stream): init, then set
+// next_in / avail_in and next_out / avail_out before each call. the rest is internal
+#define MINI_STREAM_HIST 4096  // :c: offsets are at most 3135
+#define PXA_STREAM_HIST  32768 // pxa offsets are at most 32768
+
+struct mini_stream
+{
+	// set by caller before each call; advanced past consumed input / produced output
+	uint8 *next_in;
+	int avail_in;
+	uint8 *next_out;
+	int avail_out;
+
+	int phase;
+	int header_pos;
+	int len;           // uncompressed length (from header). cut short at first 0 byte
+	int dest_pos;      // bytes decoded
+	int out_pos;       // bytes passed on to caller
+	int block_offset;
+	int future_end[2]; // end of first FUTURE_CODE, FUTURE_CODE2 in output. -1: not found (yet)
+
+	uint8 hist[MINI_STREAM_HIST]; // ring buffer: decoded byte i is at hist[i & (MINI_STREAM_HIST-1)]
+};
+
+struct pxa_stream
+{
+	// set by caller before each call; advanced past consumed input / produced output
+	uint8 *next_in;
+	int avail_in;
+	uint8 *next_out;
+	int avail_out;
+
+	int phase;
+	int raw_len, comp_len;
+	int in_pos;    // compressed bytes taken so far, including header (and zero padding after comp_len)
+	int dest_pos;  // bytes of output so far
+
+	uint64 bit_buf; // next unread bit is bit 0
+	int bit_count;
+
+	uint8 literal[256];
+	int block_offset;  // block being read / copied
+	int block_len;
+
+	uint8 hist[PXA_STREAM_HIST]; // ring buffer: output byte i is at hist[i & (PXA_STREAM_HIST-1)]
+};
+
+// p8_compress.c (:c:)
+mini_context *mini_create_context();
+void mini_free_context(mini_context *ctx);
+int compress_mini(mini_context *ctx, uint8 *in_p, uint8 *out, int len, mini_stats *stats);
+int decompress_mini(uint8 *in_p, uint8 *out_p, int max_len);
+int decompress_mini_safe(uint8 *in_p, int in_len, uint8 *out_p, int max_len);
+void mini_stream_init(mini_stream *s);
+int decompress_mini_stream(mini_stream *s);
+
+// pxa_compress_snippets.c (pxa)
+pxa_context *pxa_create_context();
+void pxa_free_context(pxa_context *ctx);
+void pxa_set_search_limits(pxa_context *ctx, int max_chain, int nice_len);
+void pxa_get_search_limits(pxa_context *ctx, int *max_chain, int *nice_len);
+void pxa_set_threads(pxa_context *ctx, int threads);
+mini_context *pxa_mini_context(pxa_context *ctx);
+int pxa_compress(pxa_context *ctx, uint8 *in_p, uint8 *out, int len, int level, pxa_stats *stats);
+int pxa_compressed_size(pxa_context *ctx, uint8 *in_p, int len, int level);
+pxa_incremental *pxa_create_incremental();
+void pxa_free_incremental(pxa_incremental *inc);
+int pxa_compress_incremental(pxa_context *ctx, pxa_incremental *inc, uint8 *in_p, uint8 *out, int len, int level);
+int pxa_decompress(pxa_context *ctx, uint8 *in_p, uint8 *out_p, int max_len);
+int pxa_decompress_safe(pxa_context *ctx, uint8 *in_p, int in_len, uint8 *out_p, int max_len);
+void pxa_stream_init(pxa_stream *s);
+int pxa_decompress_stream(pxa_stream *s);
+pxa_index *pxa_build_index(pxa_context *ctx, uint8 *in_p, int in_len, int interval);
+int pxa_index_size(pxa_index *index);
+int pxa_decompress_range(pxa_context *ctx, uint8 *in_p, pxa_index *index, int start, uint8 *out, int out_len);
+
+// pxa_compress_snippets.c (either format)
+int is_compressed_format_header(uint8 *dat);
+int pico8_code_section_compress(pxa_context *ctx, uint8 *in_p, uint8 *out, int len, int level, int *format);
+int pico8_code_section_decompress(pxa_context *ctx, uint8 *in_p, uint8 *out_p, int max_len);
+int pico8_code_section_decompress_safe(pxa_context *ctx, uint8 *in_p, int in_len, uint8 *out_p, int max_len);
+
+// p8png.c
+void p8png_extract(uint8 *rgba, uint8 *data);
+void p8png_embed(uint8 *rgba, uint8 *data);
+int p8png_decode(pxa_context *ctx, uint8 *rgba, uint8 *data, uint8 *code);
+int p8png_encode(pxa_context *ctx, uint8 *rgba, uint8 *data, uint8 *code, int code_len, int level);
+
+// p8_cache.c
+p8_cache *p8_cache_create(int max_bytes, char *store_fn, int store_size);
+void p8_cache_free(p8_cache *c);
+int p8_cache_compress(p8_cache *c, pxa_context *ctx, int codec, uint8 *in_p, uint8 *out, int len, int level, int *format);
+int p8_cache_decompress(p8_cache *c, pxa_context *ctx, uint8 *in_p, int in_len, uint8 *out_p, int max_len);
+void p8_cache_stats(p8_cache *c, int *hits, int *misses);
+
+#endif
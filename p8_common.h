@@ -0,0 +1,75 @@
+/*
+
+	p8_common.h: helpers shared by the codecs (p8_compress.c, pxa_compress_snippets.c)
+	and the files built on them. not part of the p8_codecs.h interface
+
+	allocation and MIN / MAX can be defined before including this (e.g. by an engine's own
+	headers); otherwise they fall back to the standard library
+
+*/
+
+#ifndef P8_COMMON_H
+#define P8_COMMON_H
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "p8_codecs.h"
+
+#ifndef MAX
+	#define MAX(x, y) (((x) > (y)) ? (x) : (y))
+	#define MIN(x, y) (((x) < (y)) ? (x) : (y))
+#endif
+
+#ifndef codo_malloc
+	#define codo_malloc malloc
+	#define codo_free free
+	#define codo_memset memset
+#endif
+
+// index of first differing byte in x ^ y of two 8-byte loads (x != y)
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	#define FIRST_DIFF(xy) (__builtin_clzll(xy) >> 3)
+#elif defined(__GNUC__)
+	#define FIRST_DIFF(xy) (__builtin_ctzll(xy) >> 3)
+#else
+static inline int first_diff(uint64 xy)
+{
+	int n = 0;
+	while (!(xy & 0xff)) { xy >>= 8; n++; }
+	return n;
+}
+	#define FIRST_DIFF(xy) first_diff(xy)
+#endif
+
+// number of equal bytes at a and b, up to max. 8 bytes per compare.
+// b can overlap a (a < b; repeating pattern): a[i] is the real data there, so no % needed
+static inline int p8_match_len(uint8 *a, uint8 *b, int max)
+{
+	int len = 0;
+	uint64 x, y;
+
+	for (; len + 8 <= max; len += 8)
+	{
+		memcpy(&x, a + len, 8);
+		memcpy(&y, b + len, 8);
+		if (x != y)
+			return len + FIRST_DIFF(x ^ y);
+	}
+
+	while (len < max && a[len] == b[len])
+		len ++;
+
+	return len;
+}
+
+// seconds, for per-call stats
+static inline double p8_time()
+{
+	struct timespec ts;
+	timespec_get(&ts, TIME_UTC);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+#endif
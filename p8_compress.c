@@ -27,22 +27,13 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
-
-#ifndef MAX
-	#define MAX(x, y) (((x) > (y)) ? (x) : (y))
-	#define MIN(x, y) (((x) < (y)) ? (x) : (y))
-#endif
-
-typedef unsigned char           uint8;
+#include <time.h>
+#include "p8_common.h"
 
 #define HIST_LEN 4096
 #define LITERALS 60
 #define PICO8_CODE_ALLOC_SIZE (0x10000+1)
 
-#define codo_malloc malloc
-#define codo_free free
-#define codo_memset memset
-
 // removed from end of decompressed if it exists
 // (injected to maintain 0.1.7 forwards compatibility)
 #define FUTURE_CODE "if(_update60)_update=function()_update60()_update60()end"
@@ -50,37 +41,95 @@ typedef unsigned char           uint8;
 
 // ^ is dummy -- not a literal. forgot '-', but nevermind! (gets encoded as rare literal)
 char *literal = "^\n 0123456789abcdefghijklmnopqrstuvwxyz!#%(){}[]<>+=/*:;.,~_";
-int literal_index[256]; // map literals to 0..LITERALS-1. 0 is reserved (not listed in literals string)
 
-int find_repeatable_block(uint8 *dat, int pos, int len, int *block_offset)
+// chains of earlier positions that share a 3-byte hash, oldest first.
+// replaces brute force search over whole history (~50M compares for 64k).
+#define BLOCK_HASH_MAX 4096
+#define MINI_MAX_BLOCK_LEN 17 // block len starts from 2, so no need to record 0, 1 --> max is (15 + 2)
+#define MINI_MAX_HIST_LEN ((255-LITERALS)*16) // less than HIST_LEN
+#define BLOCK_HASH(pp, i) ((pp[i+0]*7 + pp[i+1]*1503 + pp[i+2]*51717) & (BLOCK_HASH_MAX-1))
+
+typedef struct
+{
+	int head[BLOCK_HASH_MAX]; // oldest position still inside history window (-1: empty)
+	int tail[BLOCK_HASH_MAX]; // most recently added position
+	int *next;                // next (more recent) position with same hash
+	int added;                // positions < added have been linked
+} block_index;
+
+// compressor state; one per thread (no globals, so carts can be compressed concurrently)
+struct mini_context
 {
-	// block len starts from 2, so no need to record 0, 1 --> max is (15 + 2)
-	int max_block_len = 17; // any more doesn't have much effect for code. more important to look back further.
-	int max_hist_len = (255-LITERALS)*16; // less than HIST_LEN
+	int literal_index[256]; // map literals to 0..LITERALS-1. 0 is reserved (not listed in literals string)
+	block_index index;      // emptied for each input (and at switch to tail_buf)
+	int next_size;          // allocated index.next entries
+};
+
+// empty index; next[] is overwritten as positions are linked
+static void reset_block_index(block_index *index)
+{
+	int i;
+
+	for (i = 0; i < BLOCK_HASH_MAX; i++)
+		index->head[i] = index->tail[i] = -1;
+
+	index->added = 0;
+}
+
+// same result as brute force search: earliest position with the longest match.
+// only matches of 3 or more are found (shorter ones are never used)
+int find_repeatable_block(uint8 *dat, int pos, int len, int *block_offset, block_index *index)
+{
+	int max_block_len = MINI_MAX_BLOCK_LEN; // any more doesn't have much effect for code. more important to look back further.
+	int max_hist_len = MINI_MAX_HIST_LEN;
 	int i, j;
 	int best_len = 0;
 	int best_i = -100000;
 	int max_len;
-
-	// brute force search
+	int hash;
 
 	// block length can't be longer than remaining
 	max_len = MIN(max_block_len, len - pos);
 	
 	// can't be longer than preceeding data
 	max_hist_len = MIN(max_hist_len, pos); 
-	
-	for (i = pos - max_hist_len; i < pos; i++)
+
+	// link positions that can now start a match of 3 (must end before pos)
+	for (; index->added <= pos - 3; index->added++)
 	{
-		// find length starting at i
+		i = index->added;
+		hash = BLOCK_HASH(dat, i);
+
+		index->next[i] = -1;
+		if (index->head[hash] < 0)
+			index->head[hash] = i;
+		else
+			index->next[index->tail[hash]] = i;
+		index->tail[hash] = i;
+	}
+
+	if (max_len < 3) return 0;
+
+	hash = BLOCK_HASH(dat, pos);
+
+	// drop positions that have slid out of history window (window start only moves forward)
+	i = index->head[hash];
+	while (i >= 0 && i < pos - max_hist_len)
+		i = index->next[i];
+	index->head[hash] = i;
+
+	for (; i >= 0; i = index->next[i])
+	{
+		// find length starting at i (can't run past pos)
 		
-		j = i;
-		while ((j-i) < max_len && j < pos && dat[j] == dat[pos+j-i]) j++;
+		j = i + p8_match_len(&dat[i], &dat[pos], MIN(max_len, pos - i));
 		
 		if ((j-i) > best_len)
 		{
 			best_len = (j-i);
 			best_i = i;
+
+			if (best_len == max_len) break; // later positions can only tie
 		}
 	}
 	
@@ -90,49 +139,96 @@ int find_repeatable_block(uint8 *dat, int pos, int len, int *block_offset)
 }
 
 
+// injected future code is a virtual tail after the input: "\n" (when needed) + FUTURE_CODE2, padded
+// to MINI_TAIL_LEN with the 0 that used to be the string terminator (gets encoded, as before).
+// near the end, compression switches to tail_buf: recent history + rest of input + tail
+#define MINI_TAIL_LEN ((int)sizeof(FUTURE_CODE2)) // 73 + 1
+#define MINI_TAIL_BUF (MINI_MAX_HIST_LEN + MINI_MAX_BLOCK_LEN * 2 + MINI_TAIL_LEN)
+
+// index is sized for largest code section (+ tail), so compress_mini doesn't allocate
+#define MINI_INDEX_SIZE (PICO8_CODE_ALLOC_SIZE + MINI_TAIL_LEN)
+
+mini_context *mini_create_context()
+{
+	mini_context *ctx = codo_malloc(sizeof(mini_context));
+	int i;
+
+	memset(ctx, 0, sizeof(mini_context));
+	for (i = 1; i < LITERALS; i++)
+		ctx->literal_index[(uint8)literal[i]] = i;
+
+	ctx->index.next = codo_malloc(sizeof(int) * MINI_INDEX_SIZE);
+	ctx->next_size = MINI_INDEX_SIZE;
+
+	return ctx;
+}
+
+void mini_free_context(mini_context *ctx)
+{
+	if (!ctx) return;
+	codo_free(ctx->index.next);
+	codo_free(ctx);
+}
+
 #define WRITE_VAL(x) {*p_8 = (x); p_8++;}
 
-// returns compressed length
-int num_blocks, num_blocks_large, num_literals;
-int freq[256];
+static int mini_contains(uint8 *dat, int len, char *str)
+{
+	int n = strlen(str);
+	int i;
+
+	for (i = 0; i + n <= len; i++)
+		if (dat[i] == str[0] && !memcmp(dat + i, str, n))
+			return 1;
 
-int compress_mini(uint8 *in_p, uint8 *out, int len)
+	return 0;
+}
+
+// returns compressed length, or -1 if len > CODE_MAX_LEN. stats: optional (NULL)
+// in_p: len bytes, read in place (no null terminator needed, not modified)
+int compress_mini(mini_context *ctx, uint8 *in_p, uint8 *out, int len, mini_stats *stats)
 {
 	uint8 *p_8 = out;
 	int pos = 0;
 	int block_offset;
 	int block_len;
 	int i, j, best_i;
-	uint8 *in;
-	char *modified_code;
-	
-	// init literals search
-	memset(literal_index, 0, 256);
-	for (i = 1; i < LITERALS; i++)
+	uint8 *in = in_p;      // in[k] is input byte base + k
+	int base = 0;
+	int in_len = len;      // input without injected code
+	int switch_pos = len;  // switch to tail_buf here (blocks can reach tail)
+	int raw_len = len;
+	uint8 tail[MINI_TAIL_LEN];
+	uint8 tail_buf[MINI_TAIL_BUF];
+	block_index *index = &ctx->index;
+	double t_start = 0, t0 = 0, search_time = 0;
+
+	if (len > CODE_MAX_LEN) return -1;
+
+	if (stats)
 	{
-		literal_index[literal[i]] = i;
+		memset(stats, 0, sizeof(mini_stats));
+		t_start = p8_time();
 	}
 	
 	// 0.1.8 : inject future api implementation if _update60 found in in_p
 	// note: doesn't apply to plain .p8 format
 	
-	modified_code = codo_malloc(strlen(in_p) + 1024);
-	strcpy(modified_code, in_p);
-	
-	if (strstr(in_p, "_update60"))
-	if (len < PICO8_CODE_ALLOC_SIZE - (strlen(FUTURE_CODE2)+1)) // skip if won't fit when decompressing
+	if (mini_contains(in_p, len, "_update60"))
+	if (len < PICO8_CODE_ALLOC_SIZE - MINI_TAIL_LEN) // skip if won't fit when decompressing
 	{
 		// 0.1.9: make sure there is some whitespace before future_code (0.1.8 bug)
-		if (modified_code[strlen(modified_code)-1] != ' ' && modified_code[strlen(modified_code)-1] != '\n')
-		{
-			strcat(modified_code, "\n");
-		}
-		strcat(modified_code, FUTURE_CODE2);
-		len += strlen(FUTURE_CODE2)+1;
+		int nl = in_p[len-1] != ' ' && in_p[len-1] != '\n';
+
+		memset(tail, 0, MINI_TAIL_LEN);
+		tail[0] = '\n';
+		memcpy(tail + nl, FUTURE_CODE2, strlen(FUTURE_CODE2));
+		raw_len = len + nl + strlen(FUTURE_CODE2);
+
+		len += MINI_TAIL_LEN;
+		switch_pos = MAX(0, in_len - MINI_MAX_BLOCK_LEN);
 	}
 	
-	in = modified_code;
-	
 	// header tag: ":c:"
 	// will show up in code section of old versions of pico-8
 	WRITE_VAL(':');
@@ -148,20 +244,14 @@ int compress_mini(uint8 *in_p, uint8 *out, int len)
 	WRITE_VAL(0);
 	WRITE_VAL(0);
 	
-	num_blocks = 0;
-	num_literals = 0;
-	
-	memset(freq, 0, sizeof(freq));
-	#if 0
-	// generate histogram
-	for (i = 0; i < len; i++)
-		freq[in[i]]++;
-		
-	// show highest
-	for (i = 0; i < 256; i++)
-		if (freq[i] > len / 64)
-			printf("[%c] : %d\n", i, freq[i]);
-	#endif
+	// (only longer than a code section when called directly)
+	if (len > ctx->next_size)
+	{
+		codo_free(index->next);
+		index->next = codo_malloc(sizeof(int) * len);
+		ctx->next_size = len;
+	}
+	reset_block_index(index);
 	
 	while (pos < len)
 	{
@@ -169,7 +259,22 @@ int compress_mini(uint8 *in_p, uint8 *out, int len)
 		
 		//printf("pos: %d\n", pos);
 		
-		block_len = find_repeatable_block(in, pos, len, &block_offset);
+		if (pos >= switch_pos)
+		{
+			// window of history (all a block can reach) + rest of input + tail. new index: same
+			// blocks are found, as chains are in the same order and older positions are out of reach
+			base = MAX(0, pos - MINI_MAX_HIST_LEN);
+			memcpy(tail_buf, in_p + base, in_len - base);
+			memcpy(tail_buf + in_len - base, tail, MINI_TAIL_LEN);
+			in = tail_buf;
+			switch_pos = len;
+
+			reset_block_index(index);
+		}
+
+		if (stats) t0 = p8_time();
+		block_len = find_repeatable_block(in, pos - base, len - base, &block_offset, index);
+		if (stats) search_time += p8_time() - t0;
 		
 		// use block when 3 or more long. performs better than 2, because after
 		// writing first literal, second one might be part of a block.
@@ -183,47 +288,89 @@ int compress_mini(uint8 *in_p, uint8 *out, int len)
 			WRITE_VAL((block_offset % 16) + (block_len-2) * 16);
 			pos += block_len;
 			
-			// stats
-			num_blocks ++;
-			
-			if (block_len > 17) num_blocks_large++;
+			if (stats)
+			{
+				stats->block_bits += 16;
+				stats->num_blocks ++;
+				stats->len_hist[block_len] ++;
+				for (i = 0; (2 << i) <= block_offset; i++)
+					;
+				stats->offset_hist[i] ++;
+			}
 		}
 		else
 		{
 			// literal: 0 means read next byte
-			// printf(":: literal: %d [%c]\n", in[pos], in[pos]);
+			// printf(":: literal: %d [%c]\n", in[pos - base], in[pos - base]);
 			
-			WRITE_VAL(literal_index[in[pos]]);
+			WRITE_VAL(ctx->literal_index[in[pos - base]]);
 			
-			if (literal_index[in[pos]] == 0)
-				WRITE_VAL(in[pos]);
+			if (stats)
+			{
+				stats->literal_bits += 8;
+				stats->num_literals ++;
+			}
+
+			if (ctx->literal_index[in[pos - base]] == 0)
+			{
+				WRITE_VAL(in[pos - base]);
+				if (stats)
+				{
+					stats->literal_bits += 8;
+					stats->num_rare_literals ++;
+				}
+			}
 				
 			pos ++;
-			
-			// stats
-			
-			//printf("%c",in[pos]);
-			
-			num_literals ++;
-			freq[in[pos]]++;
 		}
 	}
 	
-	// compressed is larger than input -> just return input
-	if ((p_8 - out) >= strlen(in))
+	if (stats)
 	{
-		memcpy(out, in, strlen(in));
-		return strlen(in);
+		stats->stored_raw = (p_8 - out) >= raw_len;
+		stats->search_time = search_time;
+		stats->emit_time = p8_time() - t_start - search_time;
 	}
-	
-	//printf("size: %d  blocks: %d (%d large)  literals: %d\n", (p_8 - out), num_blocks, num_blocks_large, num_literals);
 
-	codo_free(modified_code);
+	// compressed is larger than input -> just return input (with injected code, without padding)
+	if ((p_8 - out) >= raw_len)
+	{
+		memcpy(out, in_p, in_len);
+		memcpy(out + in_len, tail, raw_len - in_len);
+		return raw_len;
+	}
+	
+	//printf("size: %d  blocks: %d  literals: %d\n", (p_8 - out), stats->num_blocks, stats->num_literals);
 	
 	return p_8 - out;
 }
 
 #define READ_VAL(val) {val = *in; in++;}
+
+// remove injected code (needed to be future compatible with PICO-8 C 0.1.7 / FILE_VERSION 8)
+// older versions will leave this code intact, allowing it to implement fallback 60fps support
+// out is end of decompressed data; returns new end if code was removed
+static uint8 *remove_future_code(uint8 *out_p, uint8 *out)
+{
+	if (strstr(out_p, FUTURE_CODE))
+	if (strlen(out_p)-((char *)strstr(out_p, FUTURE_CODE) - (char *)out_p) == strlen(FUTURE_CODE)) // at end
+	{
+		out = out_p + strlen(out_p) - strlen(FUTURE_CODE);
+		*out = 0;
+	}
+	
+	// queue circus music
+	if (strstr(out_p, FUTURE_CODE2))
+	if (strlen(out_p)-((char *)strstr(out_p, FUTURE_CODE2) - (char *)out_p) == strlen(FUTURE_CODE2)) // at end
+	{
+		out = out_p + strlen(out_p) - strlen(FUTURE_CODE2);
+		*out = 0;
+	}
+
+	return out;
+}
+
+// no shared state: safe to call from multiple threads
 int decompress_mini(uint8 *in_p, uint8 *out_p, int max_len)
 {
 	int block_offset;
@@ -288,78 +435,746 @@ int decompress_mini(uint8 *in_p, uint8 *out_p, int max_len)
 	}
 	
 	
-	// remove injected code (needed to be future compatible with PICO-8 C 0.1.7 / FILE_VERSION 8)
-	// older versions will leave this code intact, allowing it to implement fallback 60fps support
-	
-	if (strstr(out_p, FUTURE_CODE))
-	if (strlen(out_p)-((char *)strstr(out_p, FUTURE_CODE) - (char *)out_p) == strlen(FUTURE_CODE)) // at end
+	return remove_future_code(out_p, out) - out_p;
+}
+
+// for untrusted data (user uploads): same as decompress_mini, but never reads past in_len
+// or writes past len (<= max_len). checked once per literal / block. out_p should allocate max_len+1
+// returns decompressed length, or -1 for corrupt / truncated data
+int decompress_mini_safe(uint8 *in_p, int in_len, uint8 *out_p, int max_len)
+{
+	int block_offset;
+	int block_length;
+	int val;
+	uint8 *in = in_p + 8;
+	uint8 *in_end = in_p + in_len;
+	uint8 *out = out_p;
+	uint8 *out_end;
+	int len;
+
+	if (in_len < 8 || memcmp(in_p, ":c:", 4)) return -1;
+
+	len = in_p[4] * 256 + in_p[5];
+	if (len > max_len) return -1;
+
+	out_end = out_p + len;
+
+	while (out < out_end)
 	{
-		out = out_p + strlen(out_p) - strlen(FUTURE_CODE);
-		*out = 0;
+		if (in >= in_end) return -1;
+		READ_VAL(val);
+
+		if (val < LITERALS)
+		{
+			if (val == 0)
+			{
+				if (in >= in_end) return -1;
+				READ_VAL(val);
+				*out = val;
+			}
+			else
+				*out = literal[val];
+			out++;
+		}
+		else
+		{
+			if (in >= in_end) return -1;
+			block_offset = (val - LITERALS) * 16;
+			READ_VAL(val);
+			block_offset += val % 16;
+			block_length = (val / 16) + 2;
+
+			if (block_offset == 0 || block_offset > out - out_p || block_length > out_end - out)
+				return -1;
+
+			// compress_mini never overlaps (matches end before pos), but corrupt data can
+			if (block_offset >= block_length)
+				memcpy(out, out - block_offset, block_length);
+			else
+				for (val = 0; val < block_length; val++)
+					out[val] = out[val - block_offset];
+			out += block_length;
+		}
 	}
-	
-	// queue circus music
-	if (strstr(out_p, FUTURE_CODE2))
-	if (strlen(out_p)-((char *)strstr(out_p, FUTURE_CODE2) - (char *)out_p) == strlen(FUTURE_CODE2)) // at end
+
+	*out = 0;
+
+	return remove_future_code(out_p, out) - out_p;
+}
+
+
+// streaming decoder: same output as decompress_mini, but input and output can be passed in
+// pieces (zlib style). memory is just the MINI_STREAM_HIST history (offsets are at most 3135).
+// the last MINI_STREAM_HOLD decoded bytes are held back until the end, because they might be
+// injected FUTURE_CODE that is removed. output is not null terminated, and stops at the
+// first 0 byte like the string decompress_mini gives (compress_mini can encode one anywhere),
+// so the end isn't known from the header: hold back from the decode position, not from len.
+
+#define MINI_STREAM_HOLD (sizeof(FUTURE_CODE)-1 + sizeof(FUTURE_CODE2)-1)
+
+#define MINI_PHASE_HEADER 0
+#define MINI_PHASE_TOKEN  1
+#define MINI_PHASE_RARE   2 // literal not in list: next byte
+#define MINI_PHASE_BLOCK  3 // second byte of block
+#define MINI_PHASE_FINISH 4
+#define MINI_PHASE_DONE   5
+
+void mini_stream_init(mini_stream *s)
+{
+	memset(s, 0, sizeof(mini_stream));
+	s->phase = MINI_PHASE_HEADER;
+	s->future_end[0] = s->future_end[1] = -1;
+}
+
+// does decoded output (so far) end with str?
+static int mini_stream_ends_with(mini_stream *s, char *str)
+{
+	int n = strlen(str);
+	int i;
+
+	if (s->dest_pos < n) return 0;
+
+	for (i = 1; i <= n; i++)
+		if (s->hist[(s->dest_pos - i) & (MINI_STREAM_HIST-1)] != (uint8)str[n - i])
+			return 0;
+
+	return 1;
+}
+
+static void mini_stream_put(mini_stream *s, int c)
+{
+	s->hist[s->dest_pos & (MINI_STREAM_HIST-1)] = c;
+	s->dest_pos ++;
+
+	if (c == 0 && s->dest_pos <= s->len)
+		s->len = s->dest_pos - 1;
+
+	// both end in "end"
+	if (c == 'd')
 	{
-		out = out_p + strlen(out_p) - strlen(FUTURE_CODE2);
-		*out = 0;
+		if (s->future_end[0] < 0 && mini_stream_ends_with(s, FUTURE_CODE))  s->future_end[0] = s->dest_pos;
+		if (s->future_end[1] < 0 && mini_stream_ends_with(s, FUTURE_CODE2)) s->future_end[1] = s->dest_pos;
+	}
+}
+
+// pass decoded bytes up to end on to caller (as many as fit)
+static void mini_stream_release(mini_stream *s, int end)
+{
+	while (s->out_pos < end && s->avail_out > 0)
+	{
+		*s->next_out++ = s->hist[s->out_pos & (MINI_STREAM_HIST-1)];
+		s->avail_out --;
+		s->out_pos ++;
+	}
+}
+
+int decompress_mini_stream(mini_stream *s)
+{
+	int val;
+
+	while (1)
+	{
+		int end = MIN(s->dest_pos, s->len) - (int)MINI_STREAM_HOLD;
+
+		// keep pending output to at most one token, so that it is never overwritten in hist
+		mini_stream_release(s, end);
+		if (s->out_pos < end) return CODE_STREAM_OUTPUT;
+
+		switch (s->phase)
+		{
+		case MINI_PHASE_HEADER:
+
+			// header tag ":c:\0", uncompressed length, compressed length (unused)
+			while (s->header_pos < 8)
+			{
+				if (s->avail_in == 0) return CODE_STREAM_INPUT;
+				val = *s->next_in++;
+				s->avail_in --;
+
+				if (s->header_pos < 4 && val != ":c:"[s->header_pos]) return CODE_STREAM_ERROR;
+				if (s->header_pos == 4 || s->header_pos == 5) s->len = s->len * 256 + val;
+				s->header_pos ++;
+			}
+
+			s->phase = MINI_PHASE_TOKEN;
+			break;
+
+		case MINI_PHASE_TOKEN:
+
+			if (s->dest_pos >= s->len)
+			{
+				s->phase = MINI_PHASE_FINISH;
+				break;
+			}
+
+			if (s->avail_in == 0) return CODE_STREAM_INPUT;
+			val = *s->next_in++;
+			s->avail_in --;
+
+			if (val == 0)
+				s->phase = MINI_PHASE_RARE;
+			else if (val < LITERALS)
+				mini_stream_put(s, literal[val]);
+			else
+			{
+				s->block_offset = (val - LITERALS) * 16;
+				s->phase = MINI_PHASE_BLOCK;
+			}
+			break;
+
+		case MINI_PHASE_RARE:
+
+			if (s->avail_in == 0) return CODE_STREAM_INPUT;
+			mini_stream_put(s, *s->next_in++);
+			s->avail_in --;
+
+			s->phase = MINI_PHASE_TOKEN;
+			break;
+
+		case MINI_PHASE_BLOCK:
+		{
+			int block_length;
+
+			if (s->avail_in == 0) return CODE_STREAM_INPUT;
+			val = *s->next_in++;
+			s->avail_in --;
+
+			s->block_offset += val % 16;
+			block_length = (val / 16) + 2;
+
+			if (s->block_offset == 0 || s->block_offset > s->dest_pos) return CODE_STREAM_ERROR;
+
+			// decompress_mini writes past len here; stream output stops at len
+			block_length = MIN(block_length, s->len - s->dest_pos);
+
+			// at most 17 bytes: copy straight into hist. released at top of loop
+			while (block_length-- > 0)
+				mini_stream_put(s, s->hist[(s->dest_pos - s->block_offset) & (MINI_STREAM_HIST-1)]);
+
+			s->phase = MINI_PHASE_TOKEN;
+			break;
+		}
+
+		case MINI_PHASE_FINISH:
+
+			// remove injected code when first occurance is at end (see decompress_mini)
+			end = s->len;
+			if (s->future_end[0] == end) end -= strlen(FUTURE_CODE);
+			if (s->future_end[1] == end) end -= strlen(FUTURE_CODE2);
+
+			mini_stream_release(s, end);
+			if (s->out_pos < end) return CODE_STREAM_OUTPUT;
+
+			s->phase = MINI_PHASE_DONE;
+			break;
+
+		default:
+			return CODE_STREAM_END;
+		}
 	}
-	
-	
-	return out - out_p;
 }
 
 
-void compress_test(char *fn)
+#ifdef P8_BENCH
+
+/*
+	benchmark for both codecs (:c: and pxa at each level) over generated carts, plus any
+	files of plain code given on the command line.
+
+		cc -O2 -DP8_BENCH p8_compress.c pxa_compress_snippets.c -o p8_bench
+		./p8_bench [cart.lua ...] > bench.tsv
+
+	carts are generated from a fixed seed, so results can be compared across versions.
+	output is tab separated, one line per cart and codec:
+		cart codec len comp_len fits(<= 0x3d00) compress_MB/s decompress_MB/s roundtrip(ok/FAIL)
+	then a "total" line per codec. lines starting with # are comments.
+
+	each cart is also run through the other pxa entry points, which must give the same result as
+	pxa_compress / pxa_decompress: pxa_compress_incremental over a series of edits,
+	pxa_decompress_range, pxa_compressed_size and (with -DPXA_THREADS) the threaded pre-pass. one
+	"check" line each at the end (ok/FAIL); the exit status is 1 if any total or check failed.
+*/
+
+#define BENCH_CODECS 4
+#define BENCH_MIN_TIME (CLOCKS_PER_SEC / 10) // repeat each measurement for at least this long
+
+static char *bench_codec_name[BENCH_CODECS] = {"mini", "pxa_fast", "pxa", "pxa_max"};
+
+// pxa entry points checked against pxa_compress / pxa_decompress
+enum { BENCH_INCREMENTAL, BENCH_RANGE, BENCH_SIZE, BENCH_THREADS, BENCH_CHECKS };
+static char *bench_check_name[BENCH_CHECKS] = {"incremental", "range", "size", "threads"};
+
+// cart generator
+
+typedef struct
+{
+	char *buf;
+	int len, max;
+	unsigned int seed;
+	int minify; // short names, no indentation
+} bench_gen;
+
+static char *bench_names[] = {
+	"player", "enemies", "bullets", "particles", "timer", "score", "lives", "level",
+	"cam_x", "cam_y", "speed", "state", "frame", "tiles", "actors", "spawn_t",
+};
+
+static char *bench_calls[] = {
+	"spr", "rectfill", "circfill", "line", "print", "pset", "map", "sfx", "add", "del", "mid", "sin",
+};
+
+static int gen_rand(bench_gen *g, int n)
+{
+	g->seed = g->seed * 1103515245 + 12345;
+	return (g->seed >> 16) % n;
+}
+
+static void gen_str(bench_gen *g, char *str)
+{
+	while (*str && g->len < g->max)
+		g->buf[g->len++] = *str++;
+}
+
+static void gen_name(bench_gen *g)
 {
+	char str[4] = "a";
+	int i = gen_rand(g, 16);
+
+	if (!g->minify)
+	{
+		gen_str(g, bench_names[i]);
+		return;
+	}
+
+	str[0] = 'a' + i;
+	gen_str(g, str);
+}
+
+static void gen_num(bench_gen *g, int n)
+{
+	char str[16];
+	sprintf(str, "%d", gen_rand(g, n));
+	gen_str(g, str);
+}
+
+static void gen_indent(bench_gen *g, int depth)
+{
+	if (!g->minify)
+		while (depth-- > 0)
+			gen_str(g, " ");
+}
+
+static void gen_expr(bench_gen *g, int depth)
+{
+	switch (gen_rand(g, depth < 2 ? 6 : 4))
+	{
+		case 0: gen_name(g); break;
+		case 1: gen_num(g, 128); break;
+		case 2: gen_name(g); gen_str(g, ".x"); break;
+		case 3: gen_str(g, "flr(rnd("); gen_num(g, 16); gen_str(g, "))"); break;
+		case 4: gen_str(g, "("); gen_expr(g, depth+1); gen_str(g, g->minify ? "+" : " + "); gen_expr(g, depth+1); gen_str(g, ")"); break;
+		case 5: gen_name(g); gen_str(g, g->minify ? "*" : " * "); gen_expr(g, depth+1); break;
+	}
+}
+
+static void gen_block(bench_gen *g, int depth);
+
+static void gen_stmt(bench_gen *g, int depth)
+{
+	int i, n;
+
+	gen_indent(g, depth);
+
+	switch (gen_rand(g, depth < 3 ? 7 : 5))
+	{
+		case 0: gen_name(g); gen_str(g, g->minify ? "=" : " = "); gen_expr(g, 0); break;
+		case 1: gen_name(g); gen_str(g, g->minify ? "+=" : " += "); gen_expr(g, 0); break;
+		case 2: gen_str(g, "local "); gen_name(g); gen_str(g, g->minify ? "=" : " = "); gen_expr(g, 0); break;
+		case 3: case 4:
+			gen_str(g, bench_calls[gen_rand(g, 12)]);
+			gen_str(g, "(");
+			n = 1 + gen_rand(g, 4);
+			for (i = 0; i < n; i++)
+			{
+				if (i) gen_str(g, g->minify ? "," : ", ");
+				gen_expr(g, 1);
+			}
+			gen_str(g, ")");
+			break;
+		case 5:
+			gen_str(g, "if "); gen_expr(g, 1); gen_str(g, g->minify ? ">" : " > "); gen_expr(g, 1); gen_str(g, " then\n");
+			gen_block(g, depth+1);
+			gen_indent(g, depth); gen_str(g, "end");
+			break;
+		case 6:
+			gen_str(g, "for i=1,#"); gen_name(g); gen_str(g, " do\n");
+			gen_block(g, depth+1);
+			gen_indent(g, depth); gen_str(g, "end");
+			break;
+	}
+
+	gen_str(g, "\n");
+}
+
+static void gen_block(bench_gen *g, int depth)
+{
+	int n = 1 + gen_rand(g, 5);
+	while (n--)
+		gen_stmt(g, depth);
+}
+
+static void gen_function(bench_gen *g)
+{
+	gen_str(g, "function ");
+	gen_name(g);
+	gen_str(g, "_");
+	gen_num(g, 100);
+	gen_str(g, "()\n");
+	gen_block(g, 1);
+	gen_str(g, g->minify ? "end\n" : "end\n\n");
+}
+
+// data stored in a string: printable, close to random
+static void gen_data_string(bench_gen *g)
+{
+	int n = 200 + gen_rand(g, 600);
+	char str[2] = "a";
+
+	gen_name(g);
+	gen_str(g, "_data=\"");
+	while (n--)
+	{
+		str[0] = 0x23 + gen_rand(g, 0x7e - 0x23); // skip " and below
+		if (str[0] == '\\') str[0] = '/';
+		gen_str(g, str);
+	}
+	gen_str(g, "\"\n");
+}
+
+// kind: 0 lua  1 minified lua  2 lua with data strings  3 lua with _update60
+static int gen_cart(char *buf, int len, int kind, unsigned int seed)
+{
+	bench_gen g;
+
+	g.buf = buf;
+	g.len = 0;
+	g.max = len;
+	g.seed = seed;
+	g.minify = (kind == 1);
+
+	if (kind == 3)
+		gen_str(&g, "function _update60()\n update_t += 1\nend\n\n");
+
+	while (g.len < g.max)
+	{
+		if (kind == 2 && gen_rand(&g, 2) == 0)
+			gen_data_string(&g);
+		else
+			gen_function(&g);
+	}
+
+	buf[g.len] = 0;
+	return g.len;
+}
+
+// decoded output matches cart? (:c: adds a newline before injected code when there's no whitespace.
+// raw output from compress_mini keeps the injected code, as pico-8 would load it)
+static int bench_check(uint8 *cart, int len, uint8 *dec)
+{
+	if (memcmp(cart, dec, len)) return 0;
+	if (dec[len] == '\n') len++;
+	return dec[len] == 0 || !strcmp((char *)dec + len, FUTURE_CODE2);
+}
+
+static int bench_compress(pxa_context *pctx, mini_context *mctx, int codec, uint8 *in, uint8 *out, int len)
+{
+	if (codec == 0) return compress_mini(mctx, in, out, len, NULL);
+	return pxa_compress(pctx, in, out, len, PXA_LEVEL_FAST + codec - 1, NULL); // fast, default, max
+}
+
+// raw (when compression doesn't help) is passed through
+static void bench_decompress(pxa_context *pctx, int codec, uint8 *in, int comp_len, uint8 *out)
+{
+	memset(out, 0, 0x10001);
+	if (codec == 0 && in[0] == ':' && in[1] == 'c' && in[2] == ':' && in[3] == 0)
+		decompress_mini(in, out, 0x10000);
+	else if (codec > 0 && in[0] == 0 && in[1] == 'p' && in[2] == 'x' && in[3] == 'a')
+		pxa_decompress(pctx, in, out, 0x10000);
+	else
+		memcpy(out, in, comp_len);
+}
+
+static void bench_cart(pxa_context *pctx, mini_context *mctx, char *name, uint8 *cart, int len, double *total)
+{
+	uint8 *out = codo_malloc(0x30000);
+	uint8 *dec = codo_malloc(0x10001 + 64);
+	int codec, comp_len, ok, reps;
+	clock_t t0;
+	double c_secs, d_secs;
+
+	for (codec = 0; codec < BENCH_CODECS; codec++)
+	{
+		t0 = clock(); reps = 0;
+		do {
+			comp_len = bench_compress(pctx, mctx, codec, cart, out, len);
+			reps++;
+		} while (clock() - t0 < BENCH_MIN_TIME);
+		c_secs = (double)(clock() - t0) / CLOCKS_PER_SEC / reps;
+
+		t0 = clock(); reps = 0;
+		do {
+			bench_decompress(pctx, codec, out, comp_len, dec);
+			reps++;
+		} while (clock() - t0 < BENCH_MIN_TIME);
+		d_secs = (double)(clock() - t0) / CLOCKS_PER_SEC / reps;
+
+		ok = bench_check(cart, len, dec);
+
+		printf("%s\t%s\t%d\t%d\t%d\t%.3f\t%.3f\t%s\n", name, bench_codec_name[codec], len, comp_len,
+			comp_len <= CODE_SECTION_SIZE, len / c_secs / 1e6, len / d_secs / 1e6, ok ? "ok" : "FAIL");
+
+		// len, comp_len, fits, compress secs, decompress secs, failures
+		total[codec*6 + 0] += len;
+		total[codec*6 + 1] += comp_len;
+		total[codec*6 + 2] += comp_len <= CODE_SECTION_SIZE;
+		total[codec*6 + 3] += c_secs;
+		total[codec*6 + 4] += d_secs;
+		total[codec*6 + 5] += !ok;
+	}
+
+	codo_free(out);
+	codo_free(dec);
+}
+
+static void bench_fail(char *name, int check, int level, int *failures)
+{
+	printf("# %s: %s FAIL at level %d\n", name, bench_check_name[check], level);
+	failures[check] ++;
+}
+
+// edit cart in place: change a byte, or insert / delete a few. returns new length
+static int bench_edit(bench_gen *g, uint8 *cart, int len)
+{
+	int pos = gen_rand(g, len), n = 1 + gen_rand(g, 64);
+
+	switch (gen_rand(g, 3))
+	{
+		case 0: cart[pos] ^= 1; break;
+		case 1:
+			if (len + n > 0xffff) break;
+			memmove(cart + pos + n, cart + pos, len - pos);
+			memcpy(cart + pos, cart + gen_rand(g, len), n);
+			len += n;
+			break;
+		case 2:
+			n = MIN(n, len - pos - 1);
+			memmove(cart + pos, cart + pos + n, len - pos - n);
+			len -= n;
+			break;
+	}
+
+	cart[len] = 0;
+	return len;
+}
+
+// pxa entry points other than pxa_compress / pxa_decompress against those (the reference)
+static void bench_check_pxa(pxa_context *pctx, char *name, uint8 *cart, int len, int *failures)
+{
+	pxa_context *tctx = pxa_create_context();
+	pxa_incremental *inc;
+	pxa_index *index;
+	bench_gen g;
+	uint8 *edited = codo_malloc(0x10001);
+	uint8 *ref = codo_malloc(0x30000);
+	uint8 *out = codo_malloc(0x30000);
+	uint8 *dec = codo_malloc(0x10001);
+	uint8 *part = codo_malloc(0x10000);
+	int level, i, ref_len, out_len, edited_len, start, n;
+
+	g.seed = len;
+
+	// reference: no pre-pass threads
+	pxa_set_threads(pctx, 1);
+	pxa_set_threads(tctx, 4);
+
+	for (level = PXA_LEVEL_FAST; level <= PXA_LEVEL_MAX; level++)
+	{
+		ref_len = pxa_compress(pctx, cart, ref, len, level, NULL);
+
+		if (pxa_compressed_size(pctx, cart, len, level) != ref_len)
+			bench_fail(name, BENCH_SIZE, level, failures);
+
+		out_len = pxa_compress(tctx, cart, out, len, level, NULL);
+		if (out_len != ref_len || memcmp(out, ref, ref_len))
+			bench_fail(name, BENCH_THREADS, level, failures);
+
+		// first call compresses everything, then each edit resumes from a checkpoint
+		inc = pxa_create_incremental();
+		memcpy(edited, cart, len + 1);
+		edited_len = len;
+
+		for (i = 0; i < 6; i++)
+		{
+			if (i > 0) edited_len = bench_edit(&g, edited, edited_len);
+
+			ref_len = pxa_compress(pctx, edited, ref, edited_len, level, NULL);
+			out_len = pxa_compress_incremental(pctx, inc, edited, out, edited_len, level);
+			if (out_len != ref_len || memcmp(out, ref, ref_len))
+			{
+				bench_fail(name, BENCH_INCREMENTAL, level, failures);
+				break;
+			}
+		}
+
+		// size only (out NULL) after one more edit
+		edited_len = bench_edit(&g, edited, edited_len);
+		if (pxa_compress_incremental(pctx, inc, edited, NULL, edited_len, level) !=
+			pxa_compressed_size(pctx, edited, edited_len, level))
+			bench_fail(name, BENCH_SIZE, level, failures);
+
+		pxa_free_incremental(inc);
+	}
+
+	// random ranges against the whole decoded cart
+	ref_len = pxa_compress(pctx, cart, ref, len, PXA_LEVEL_DEFAULT, NULL);
+	if (ref_len >= 8 && ref[0] == 0 && ref[1] == 'p' && ref[2] == 'x' && ref[3] == 'a')
+	{
+		memset(dec, 0, 0x10001);
+		pxa_decompress(pctx, ref, dec, 0x10000);
+
+		if (!(index = pxa_build_index(pctx, ref, ref_len, 1024)))
+			bench_fail(name, BENCH_RANGE, PXA_LEVEL_DEFAULT, failures);
+		else
+		{
+			for (i = 0; i < 64; i++)
+			{
+				start = gen_rand(&g, len);
+				n = 1 + gen_rand(&g, i < 32 ? 256 : 8192);
+				out_len = pxa_decompress_range(pctx, ref, index, start, part, n);
+				if (out_len != MIN(n, len - start) || memcmp(part, dec + start, out_len))
+				{
+					bench_fail(name, BENCH_RANGE, PXA_LEVEL_DEFAULT, failures);
+					break;
+				}
+			}
+			codo_free(index);
+		}
+	}
+
+	pxa_set_threads(pctx, 0);
+	pxa_free_context(tctx);
+	codo_free(edited);
+	codo_free(ref);
+	codo_free(out);
+	codo_free(dec);
+	codo_free(part);
+}
+
+int main(int argc, char *argv[])
+{
+	// name, length, kind (see gen_cart)
+	static struct { char *name; int len, kind; } carts[] = {
+		{"lua_4k",    4096,  0},
+		{"lua_15k",   15000, 0},
+		{"lua_30k",   30000, 0},
+		{"lua_64k",   65000, 0},
+		{"min_15k",   15000, 1},
+		{"min_64k",   65000, 1},
+		{"data_15k",  15000, 2},
+		{"data_64k",  65000, 2},
+		{"upd60_20k", 20000, 3},
+	};
+	mini_context *mctx = mini_create_context();
+	pxa_context *pctx = pxa_create_context();
+	double total[BENCH_CODECS * 6] = {0};
+	int failures[BENCH_CHECKS] = {0};
+	uint8 *cart = codo_malloc(0x10001);
+	int i, len, codec, failed = 0;
 	FILE *f;
-	uint8 *dat;
-	uint8 *out;
-	int len;
-	int comp_len;
-	int decomp_len;
-	int i;
-	
-	dat = malloc(65536);
-	out = malloc(65536);
-	
-	f = fopen(fn, "r");
-	
-	len = fread(dat, 1, 65536, f);
-	fclose(f);
-	
-	//comp_len = codo_compress_lz4_hc(dat, out, len); // not as good as compress_mini()
-	comp_len = compress_mini(dat, out, len);
-	
-	memset(dat, 0, 65536);
-	
-	decomp_len = decompress_mini(out, dat, 65536);
-
-	// show highest freq of literals
-	#if 0
-	for (i = 0; i < 256; i++)
-		if (freq[i] > 50)
-			printf("[%c] : %d\n", i, freq[i]);
-	#endif
-	printf("len %d --> comp_len %d\n", len, comp_len);
-	printf("decomp_len: %d\n", decomp_len);
-	
-	printf("blocks: %d literals %d\n", num_blocks, num_literals);
-	printf("block len: %3.3f\n", (float)(len - num_literals) / (float)num_blocks);
-	
-	//printf("output: %s\n", dat);
-	f = fopen("out.txt", "wb");
-	fwrite(dat, 1, strlen(dat), f);
-	fclose(f);
-	
-	free(dat);
-	free(out);
+
+	printf("# cart\tcodec\tlen\tcomp_len\tfits\tcompress_mb_s\tdecompress_mb_s\troundtrip\n");
+
+	for (i = 0; i < sizeof(carts) / sizeof(carts[0]); i++)
+	{
+		len = gen_cart(cart, carts[i].len, carts[i].kind, 1234 + i);
+		bench_cart(pctx, mctx, carts[i].name, cart, len, total);
+		bench_check_pxa(pctx, carts[i].name, cart, len, failures);
+	}
+
+	for (i = 1; i < argc; i++)
+	{
+		f = fopen(argv[i], "rb");
+		if (!f) { printf("# can't open %s\n", argv[i]); continue; }
+		len = fread(cart, 1, 0xffff, f);
+		fclose(f);
+		cart[len] = 0;
+		bench_cart(pctx, mctx, argv[i], cart, len, total);
+		if (len > 0) bench_check_pxa(pctx, argv[i], cart, len, failures);
+	}
+
+	for (codec = 0; codec < BENCH_CODECS; codec++)
+	{
+		double *t = total + codec * 6;
+		printf("total\t%s\t%.0f\t%.0f\t%.0f\t%.3f\t%.3f\t%s\n", bench_codec_name[codec], t[0], t[1], t[2],
+			t[0] / t[3] / 1e6, t[0] / t[4] / 1e6, t[5] ? "FAIL" : "ok");
+		failed |= (t[5] != 0);
+	}
+
+	for (i = 0; i < BENCH_CHECKS; i++)
+	{
+		printf("check\t%s\t%s\n", bench_check_name[i], failures[i] ? "FAIL" : "ok");
+		failed |= (failures[i] != 0);
+	}
+
+	codo_free(cart);
+	pxa_free_context(pctx);
+	mini_free_context(mctx);
+
+	return failed;
 }
 
-int main(int argc,  char *argv[])
+#endif
+
+#ifdef MINI_FUZZ
+
+// libFuzzer target:
+//   clang -g -O1 -fsanitize=fuzzer,address -DMINI_FUZZ p8_compress.c
+//   ./a.out corpus fuzz/mini     (new inputs go to corpus; fuzz/mini: seeds, including past failures)
+// runs decompress_mini_safe and the streaming decoder (in small pieces) on the same input.
+// when the checked decoder accepts data, the stream must give the same string.
+
+int LLVMFuzzerTestOneInput(const uint8 *data, size_t size)
 {
-	if (argc > 1)
-		compress_test(argv[1]);
+	static mini_stream s;
+	static uint8 out[0x10001];
+	static uint8 out2[0x10000];
+	uint8 *in;
+	int len, result;
+
+	// copy so that reads past size are caught
+	in = codo_malloc(MAX(size, 1));
+	memcpy(in, data, size);
+
+	len = decompress_mini_safe(in, size, out, 0x10000);
+
+	mini_stream_init(&s);
+	s.next_in = in;
+	s.next_out = out2;
+	s.avail_out = sizeof(out2);
+	do {
+		s.avail_in = MIN(7, (int)size - (int)(s.next_in - in));
+		result = decompress_mini_stream(&s);
+	} while (result == CODE_STREAM_INPUT && s.avail_in == 0 && s.next_in < in + size);
+
+	if (len >= 0)
+	{
+		len = strlen(out);
+		if (result != CODE_STREAM_END || s.next_out - out2 != len || memcmp(out, out2, len))
+			abort();
+	}
+
+	codo_free(in);
+	return 0;
 }
 
+#endif
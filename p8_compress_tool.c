@@ -0,0 +1,374 @@
+/*
+
+	p8_compress_tool: compress / decompress / verify many code sections at once
+
+		cc -O2 p8_compress_tool.c p8_compress.c pxa_compress_snippets.c -lpthread -o p8_compress_tool
+
+		p8_compress_tool [options] path ...
+
+		-c            compress (default). writes name.p8code
+		-d            decompress. writes name without .p8code (or name.lua)
+		-v            verify: compress, decompress and compare. writes nothing
+		-f format     auto (smaller that fits, see pico8_code_section_compress), mini (:c:) or pxa
+		-l level      pxa level: 0 fast, 1 default, 2 max
+		-j threads    default: number of cores
+		-o dir        write outputs into dir instead of next to inputs (input names must be unique)
+
+	paths are files, directories (all files, recursively) or @list (one path per line).
+	inputs (up to 65535 bytes) are memory mapped. prints one line per file; exit status is 1 if any
+	failed.
+
+*/
+
+#include "p8_codecs.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifndef MAX
+	#define MAX(x, y) (((x) > (y)) ? (x) : (y))
+	#define MIN(x, y) (((x) < (y)) ? (x) : (y))
+#endif
+
+#define TOOL_MAX_CODE CODE_MAX_LEN // lengths in headers are 16 bits
+#define TOOL_OUT_SIZE 0x30000 // encoder output before raw fallback can be larger than input
+#define TOOL_EXT ".p8code"
+
+enum { TOOL_COMPRESS, TOOL_DECOMPRESS, TOOL_VERIFY };
+enum { TOOL_AUTO, TOOL_MINI, TOOL_PXA };
+
+typedef struct
+{
+	int mode, format, level;
+	int num_threads;
+	char *out_dir;
+
+	char **files;
+	int num_files, max_files;
+
+	int next;     // next file to process (under lock)
+	int failed;
+	pthread_mutex_t lock;
+} tool_state;
+
+static void add_file(tool_state *st, char *path)
+{
+	if (st->num_files == st->max_files)
+	{
+		st->max_files = st->max_files ? st->max_files * 2 : 1024;
+		st->files = realloc(st->files, st->max_files * sizeof(char *));
+	}
+	st->files[st->num_files++] = strdup(path);
+}
+
+static void add_path(tool_state *st, char *path)
+{
+	struct stat sb;
+	DIR *dir;
+	struct dirent *ent;
+	char buf[4096];
+	FILE *f;
+
+	if (path[0] == '@')
+	{
+		if (!(f = fopen(path + 1, "r"))) { fprintf(stderr, "can't open list %s\n", path + 1); st->failed = 1; return; }
+		while (fgets(buf, sizeof(buf), f))
+		{
+			buf[strcspn(buf, "\r\n")] = 0;
+			if (buf[0]) add_path(st, buf);
+		}
+		fclose(f);
+		return;
+	}
+
+	if (stat(path, &sb)) { fprintf(stderr, "can't find %s\n", path); st->failed = 1; return; }
+
+	if (!S_ISDIR(sb.st_mode))
+	{
+		add_file(st, path);
+		return;
+	}
+
+	if (!(dir = opendir(path))) return;
+	while ((ent = readdir(dir)))
+	{
+		if (ent->d_name[0] == '.') continue;
+		snprintf(buf, sizeof(buf), "%s/%s", path, ent->d_name);
+		add_path(st, buf);
+	}
+	closedir(dir);
+}
+
+// output name: next to input or in out_dir
+static void out_name(tool_state *st, char *in, char *out, int size)
+{
+	char name[4096];
+	char *base = strrchr(in, '/');
+	int n;
+
+	snprintf(name, sizeof(name), "%s", (st->out_dir && base) ? base + 1 : in);
+	n = strlen(name);
+
+	if (st->mode == TOOL_COMPRESS)
+		snprintf(name + n, sizeof(name) - n, TOOL_EXT);
+	else if (n > strlen(TOOL_EXT) && !strcmp(name + n - strlen(TOOL_EXT), TOOL_EXT))
+		name[n - strlen(TOOL_EXT)] = 0;
+	else
+		snprintf(name + n, sizeof(name) - n, ".lua");
+
+	if (st->out_dir)
+		snprintf(out, size, "%s/%s", st->out_dir, name);
+	else
+		snprintf(out, size, "%s", name);
+}
+
+static int cmp_names(const void *a, const void *b)
+{
+	return strcmp(*(char **)a, *(char **)b);
+}
+
+// with -o, inputs with the same name from different directories would write the same file.
+// returns 0 (after listing them) if any do
+static int check_out_names(tool_state *st)
+{
+	char **names = malloc(st->num_files * sizeof(char *));
+	char buf[4096];
+	int i, ok = 1;
+
+	for (i = 0; i < st->num_files; i++)
+	{
+		out_name(st, st->files[i], buf, sizeof(buf));
+		names[i] = strdup(buf);
+	}
+
+	qsort(names, st->num_files, sizeof(char *), cmp_names);
+
+	for (i = 1; i < st->num_files; i++)
+		if (!strcmp(names[i-1], names[i]) && (i < 2 || strcmp(names[i-2], names[i])))
+		{
+			fprintf(stderr, "more than one input writes %s\n", names[i]);
+			ok = 0;
+		}
+
+	for (i = 0; i < st->num_files; i++)
+		free(names[i]);
+	free(names);
+	return ok;
+}
+
+// per thread buffers and codec contexts
+typedef struct
+{
+	pxa_context *pctx;
+	uint8 *comp, *dec;
+} tool_worker;
+
+static int tool_compress(tool_state *st, tool_worker *w, uint8 *in, int len, int *format)
+{
+	int comp_len;
+
+	if (st->format == TOOL_AUTO)
+		return pico8_code_section_compress(w->pctx, in, w->comp, len, st->level, format);
+
+	if (st->format == TOOL_MINI)
+		comp_len = compress_mini(pxa_mini_context(w->pctx), in, w->comp, len, NULL);
+	else
+		comp_len = pxa_compress(w->pctx, in, w->comp, len, st->level, NULL);
+
+	// encoders return input as is when compressing doesn't help
+	*format = comp_len >= 8 ? is_compressed_format_header(w->comp) : 0;
+	return comp_len;
+}
+
+static int write_file(char *fn, uint8 *dat, int len)
+{
+	FILE *f = fopen(fn, "wb");
+	int ok;
+
+	if (!f) return 0;
+	ok = fwrite(dat, 1, len, f) == len;
+	return fclose(f) == 0 && ok;
+}
+
+// returns 0 on failure. msg: result for this file
+static int process_file(tool_state *st, tool_worker *w, char *fn, char *msg, int msg_size)
+{
+	char out_fn[4096];
+	struct stat sb;
+	uint8 *in;
+	int fd, len, comp_len, dec_len, format = 0, ok = 1;
+
+	if ((fd = open(fn, O_RDONLY)) < 0 || fstat(fd, &sb))
+	{
+		if (fd >= 0) close(fd);
+		snprintf(msg, msg_size, "can't open");
+		return 0;
+	}
+
+	len = sb.st_size;
+	if (len > TOOL_MAX_CODE)
+	{
+		close(fd);
+		snprintf(msg, msg_size, "too large (%d bytes)", len);
+		return 0;
+	}
+
+	in = len ? mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+	close(fd);
+	if (len && in == MAP_FAILED)
+	{
+		snprintf(msg, msg_size, "can't map");
+		return 0;
+	}
+
+	out_name(st, fn, out_fn, sizeof(out_fn));
+
+	if (st->mode == TOOL_DECOMPRESS)
+	{
+		dec_len = len ? pico8_code_section_decompress_safe(w->pctx, in, len, w->dec, TOOL_MAX_CODE) : 0;
+		if (dec_len < 0)
+		{
+			snprintf(msg, msg_size, "corrupt");
+			ok = 0;
+		}
+		else
+		{
+			snprintf(msg, msg_size, "%d -> %d", len, dec_len);
+			ok = write_file(out_fn, w->dec, dec_len);
+		}
+	}
+	else
+	{
+		// encoders read mapped input in place
+		comp_len = tool_compress(st, w, in, len, &format);
+		snprintf(msg, msg_size, "%d -> %d (%s)", len, comp_len,
+			comp_len < 0 ? "doesn't fit" : format == 1 ? ":c:" : format == 2 ? "pxa" : "raw");
+		ok = comp_len >= 0;
+
+		if (ok && st->mode == TOOL_VERIFY && format == 0 && comp_len > CODE_SECTION_SIZE)
+		{
+			// raw from mini / pxa encoders (compression didn't help): only readable if it fits
+			snprintf(msg + strlen(msg), msg_size - strlen(msg), " doesn't fit");
+			ok = 0;
+		}
+		else if (ok && st->mode == TOOL_VERIFY)
+		{
+			memset(w->dec, 0, TOOL_MAX_CODE + 1);
+			dec_len = pico8_code_section_decompress_safe(w->pctx, w->comp, comp_len, w->dec, TOOL_MAX_CODE);
+			ok = dec_len >= len && !memcmp(w->dec, in, len);
+			if (!ok) snprintf(msg + strlen(msg), msg_size - strlen(msg), " roundtrip FAILED");
+		}
+		else if (ok)
+			ok = write_file(out_fn, w->comp, comp_len);
+	}
+
+	if (len) munmap(in, len);
+	return ok;
+}
+
+static void *worker_main(void *arg)
+{
+	tool_state *st = arg;
+	tool_worker w;
+	char msg[256];
+	int i, ok;
+
+	w.pctx = pxa_create_context();
+	if (st->num_threads > 1)
+		pxa_set_threads(w.pctx, 1); // files are already spread over cores
+	w.comp = malloc(TOOL_OUT_SIZE);
+	w.dec  = malloc(TOOL_MAX_CODE + 1);
+
+	for (;;)
+	{
+		pthread_mutex_lock(&st->lock);
+		i = st->next++;
+		pthread_mutex_unlock(&st->lock);
+		if (i >= st->num_files) break;
+
+		ok = process_file(st, &w, st->files[i], msg, sizeof(msg));
+
+		pthread_mutex_lock(&st->lock);
+		printf("%s\t%s\t%s\n", ok ? "ok" : "FAIL", st->files[i], msg);
+		if (!ok) st->failed = 1;
+		pthread_mutex_unlock(&st->lock);
+	}
+
+	pxa_free_context(w.pctx);
+	free(w.comp);
+	free(w.dec);
+	return NULL;
+}
+
+static void usage()
+{
+	fprintf(stderr, "usage: p8_compress_tool [-c|-d|-v] [-f auto|mini|pxa] [-l level] [-j threads] [-o dir] path ...\n");
+	exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+	static tool_state st;
+	pthread_t *threads;
+	char *end;
+	int i, started, num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+	st.level = PXA_LEVEL_DEFAULT;
+	pthread_mutex_init(&st.lock, NULL);
+
+	for (i = 1; i < argc; i++)
+	{
+		char *a = argv[i];
+
+		if (a[0] != '-') { add_path(&st, a); continue; }
+
+		if (!strcmp(a, "-c")) st.mode = TOOL_COMPRESS;
+		else if (!strcmp(a, "-d")) st.mode = TOOL_DECOMPRESS;
+		else if (!strcmp(a, "-v")) st.mode = TOOL_VERIFY;
+		else if (i + 1 >= argc) usage();
+		else if (!strcmp(a, "-f"))
+		{
+			a = argv[++i];
+			if (!strcmp(a, "auto")) st.format = TOOL_AUTO;
+			else if (!strcmp(a, "mini")) st.format = TOOL_MINI;
+			else if (!strcmp(a, "pxa")) st.format = TOOL_PXA;
+			else usage();
+		}
+		else if (!strcmp(a, "-l"))
+		{
+			st.level = strtol(argv[++i], &end, 10);
+			if (*end || end == argv[i] || st.level < PXA_LEVEL_FAST || st.level > PXA_LEVEL_MAX) usage();
+		}
+		else if (!strcmp(a, "-j")) num_threads = atoi(argv[++i]);
+		else if (!strcmp(a, "-o")) st.out_dir = argv[++i];
+		else usage();
+	}
+
+	if (!st.num_files && !st.failed) usage();
+
+	if (st.out_dir && st.mode != TOOL_VERIFY && !check_out_names(&st))
+		return 1;
+
+	num_threads = MAX(1, MIN(num_threads, st.num_files));
+	st.num_threads = num_threads;
+	threads = malloc(num_threads * sizeof(pthread_t));
+
+	// fewer threads if they can't be started (none: work on this one)
+	for (started = 0; started < num_threads; started++)
+		if (pthread_create(&threads[started], NULL, worker_main, &st)) break;
+
+	if (started == 0)
+		worker_main(&st);
+
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	free(threads);
+	return st.failed;
+}
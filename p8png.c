@@ -0,0 +1,101 @@
+/*
+
+	P8PNG cartridge data: encode / decode the 160x205 .p8.png image
+
+	the cart is stored in the low 2 bits of each channel: one byte per pixel, ordered ARGB
+	(a holds the top 2 bits). first 0x8000 bytes are the rom; code section is 0x4300..0x7fff.
+	byte 0x8000 is the file version, followed by pico-8 version info (left to caller).
+
+	this file works on the decoded image (rgba, 8 bits per channel, row major, 160x205), so
+	the caller can use any png reader / writer.
+
+	license: same as pxa_compress_snippets.c (MIT)
+
+*/
+
+#include "p8_codecs.h"
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64)
+	#include <emmintrin.h>
+	#define P8PNG_SSE2
+#endif
+
+// pixel (r,g,b,a in memory) -> aarrggbb
+#define P8PNG_PIXEL_BYTE(p) (((p)[3] & 3) << 6 | ((p)[0] & 3) << 4 | ((p)[1] & 3) << 2 | ((p)[2] & 3))
+
+// rgba: P8PNG_DATA_SIZE*4 bytes. data: P8PNG_DATA_SIZE bytes
+void p8png_extract(uint8 *rgba, uint8 *data)
+{
+	int i = 0;
+
+#ifdef P8PNG_SSE2
+	// 16 pixels at a time. each 32-bit lane is one pixel: r | g<<8 | b<<16 | a<<24
+	__m128i mask = _mm_set1_epi32(0x03030303);
+
+	for (; i + 16 <= P8PNG_DATA_SIZE; i += 16)
+	{
+		__m128i v[4];
+		int k;
+
+		for (k = 0; k < 4; k++)
+		{
+			__m128i x = _mm_and_si128(_mm_loadu_si128((__m128i *)(rgba + (i + k * 4) * 4)), mask);
+			v[k] = _mm_or_si128(
+				_mm_or_si128(_mm_and_si128(_mm_slli_epi32(x, 4),  _mm_set1_epi32(0x30)),  // r
+				             _mm_and_si128(_mm_srli_epi32(x, 6),  _mm_set1_epi32(0x0c))), // g
+				_mm_or_si128(_mm_and_si128(_mm_srli_epi32(x, 16), _mm_set1_epi32(0x03)),  // b
+				             _mm_and_si128(_mm_srli_epi32(x, 18), _mm_set1_epi32(0xc0)))); // a
+		}
+
+		// lanes are 0..255: saturating packs don't change them
+		_mm_storeu_si128((__m128i *)(data + i),
+			_mm_packus_epi16(_mm_packs_epi32(v[0], v[1]), _mm_packs_epi32(v[2], v[3])));
+	}
+#endif
+
+	for (rgba += i * 4; i < P8PNG_DATA_SIZE; i++, rgba += 4)
+		data[i] = P8PNG_PIXEL_BYTE(rgba);
+}
+
+// replace low 2 bits of each channel with data (rest of image is the cart label)
+void p8png_embed(uint8 *rgba, uint8 *data)
+{
+	int i;
+
+	for (i = 0; i < P8PNG_DATA_SIZE; i++)
+	{
+		uint8 *p = rgba + i * 4;
+		p[0] = (p[0] & ~3) | ((data[i] >> 4) & 3);
+		p[1] = (p[1] & ~3) | ((data[i] >> 2) & 3);
+		p[2] = (p[2] & ~3) | (data[i] & 3);
+		p[3] = (p[3] & ~3) | (data[i] >> 6);
+	}
+}
+
+// extract cart data and decompress code section. image is untrusted (checked decoders)
+// data: P8PNG_DATA_SIZE bytes. code: 0x10001 bytes (null terminated)
+// returns code length, or -1 for corrupt code section
+int p8png_decode(pxa_context *ctx, uint8 *rgba, uint8 *data, uint8 *code)
+{
+	p8png_extract(rgba, data);
+	return pico8_code_section_decompress_safe(ctx, data + P8PNG_CODE_OFFSET, P8PNG_CODE_SIZE, code, 0x10000);
+}
+
+// compress code into data's code section (smaller of :c: and pxa, see pico8_code_section_compress)
+// and embed data in the image. rest of data (rom, version info) is written by caller.
+// code: code_len bytes
+// returns compressed code length, or -1 if code doesn't fit or code_len > CODE_MAX_LEN (image is
+// left unchanged)
+int p8png_encode(pxa_context *ctx, uint8 *rgba, uint8 *data, uint8 *code, int code_len, int level)
+{
+	int len = pico8_code_section_compress(ctx, code, data + P8PNG_CODE_OFFSET, code_len, level, NULL);
+
+	if (len < 0) return -1;
+
+	// unused end of code section is zeroed
+	memset(data + P8PNG_CODE_OFFSET + len, 0, P8PNG_CODE_SIZE - len);
+	p8png_embed(rgba, data);
+
+	return len;
+}
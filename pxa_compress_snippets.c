@@ -26,7 +26,12 @@
 
 */
 
-#include "pico8.h"
+#include "p8_common.h"
+
+#ifdef PXA_THREADS
+#include <pthread.h>
+#include <unistd.h>
+#endif
 
 
 
@@ -42,110 +47,239 @@
 #define MIN_BLOCK_LEN 3
 #define HASH_MAX 4096
 #define MINI_HASH(pp, i) ((pp[i+0]*7 + pp[i+1]*1503 + pp[i+2]*51717) & (HASH_MAX-1))
+#define TRIGRAM(pp, i) ((pp)[(i)+0] | (pp)[(i)+1] << 8 | (pp)[(i)+2] << 16)
 
-typedef unsigned short int uint16;
-typedef unsigned char uint8;
+// search limits per level (see pxa_set_search_limits)
+#define PXA_FAST_MAX_CHAIN 32
+#define PXA_FAST_NICE_LEN  32
+#define PXA_MAX_MAX_CHAIN  1024
 
-static uint16 *hash_list[HASH_MAX];
-static uint16 *hash_heap = NULL;
-static int found[HASH_MAX];
+typedef unsigned short int uint16;
 
 #define WRITE_VAL(x) {*p_8 = (x); p_8++;}
 
 
-static int bit = 1;
-static int byte = 0;
-static int dest_pos = 0;
-static int src_pos = 0;
+// all encoder / decoder state lives here (no globals), so that carts can be
+// compressed and decompressed on many threads at once: one context per thread.
 
+struct pxa_context
+{
+	// bit-level read/write position
+	int dest_pos;
+	int src_pos;
+	uint8 *dest_buf;
+	uint8 *src_buf;
+
+	// encoder bit accumulator: put_count pending bits (not yet in dest_buf) from bit 0 up
+	uint64 put_buf;
+	int put_count;
+
+	// decoder bit buffer: next unread bit is bit 0. src_pos is next byte to load
+	uint64 bit_buf;
+	int bit_count;
+	int src_len;
+
+	// decoder lookup tables (built by pxa_create_context)
+	uint8 literal_cat[256];  // length of literal category prefix (run of 1s) in next 8 bits
+	uint16 len_chain[512];   // next 3 block length links: (bits used << 8) | sum of link values
+
+	// positions of each hash (encoder), ascending: hash_pos[hash_start[h] .. hash_start[h+1]-1]
+	int hash_start[HASH_MAX + 1];
+	uint16 *hash_pos;
+	int hash_pos_size; // allocated entries
+	int found[HASH_MAX];
+
+	// exact index (fast, max levels): hash_pos sorted by whole trigram instead of MINI_HASH, so
+	// no collisions. earlier positions with same 3 bytes as pos: hash_pos[key_start[pos] .. key_rank[pos]-1]
+	int exact_index;
+	uint16 *key_start, *key_rank;
+	int key_size;
+
+	// encoder search limits (from level, unless set by pxa_set_search_limits)
+	int max_chain;  // most recent in-window hash list entries to try per position. 0: all
+	int nice_len;   // stop searching at a match this long. 0: no limit
+	int user_max_chain, user_nice_len;
+
+	int read_end; // input before this is all that pxa_find_repeatable_block has looked at so far
+
+	// match pre-pass (PXA_THREADS): match[pos] for pos in input, when use_match
+	int threads; // 0: number of cores. 1: no pre-pass
+	struct pxa_match *match;
+	int match_size, use_match;
+
+	mini_context *mctx; // :c: encoder for pico8_code_section_compress (see pxa_mini_context)
+};
+
+
+static void build_decode_tables(pxa_context *ctx)
+{
+	int i, k;
 
-//-------------------------------------------------
-// pxa bit-level read/write help functions
-//-------------------------------------------------
+	for (i = 0; i < 256; i++)
+	{
+		for (k = 0; k < 8 && (i & (1 << k)); k++)
+			;
+		ctx->literal_cat[i] = k;
+	}
 
-static uint8 *dest_buf = NULL;
-static uint8 *src_buf = NULL;
+	for (i = 0; i < 512; i++)
+	{
+		int sum = 0, bits = 0, vv = 7;
+		for (k = 0; k < 3 && vv == 7; k++)
+		{
+			vv = (i >> (k * BLOCK_LEN_CHAIN_BITS)) & 7;
+			sum += vv;
+			bits += BLOCK_LEN_CHAIN_BITS;
+		}
+		ctx->len_chain[i] = (bits << 8) | sum;
+	}
+}
 
-// 0.2.0j
-// encode / decode as an int
-static int get_write_pos()
+pxa_context *pxa_create_context()
 {
-	int result = (dest_pos << 16) | (byte << 8) | bit;
-	return result;
+	pxa_context *ctx = codo_malloc(sizeof(pxa_context));
+	memset(ctx, 0, sizeof(pxa_context));
+	build_decode_tables(ctx);
+	return ctx;
 }
-static void set_write_pos(int val)
+
+// override the level's search limits (0: use level's). bounds time spent on pathological
+// input (long runs of similar data) at the cost of ratio. changes PXA_LEVEL_DEFAULT output.
+void pxa_set_search_limits(pxa_context *ctx, int max_chain, int nice_len)
 {
-	bit = val & 0xff;
-	byte = (val >> 8) & 0xff;
-	dest_pos = (val >> 16) & 0x7fff;
+	ctx->user_max_chain = max_chain;
+	ctx->user_nice_len = nice_len;
 }
 
+// current overrides (for callers that key results on them, e.g. p8_cache)
+void pxa_get_search_limits(pxa_context *ctx, int *max_chain, int *nice_len)
+{
+	*max_chain = ctx->user_max_chain;
+	*nice_len = ctx->user_nice_len;
+}
 
+// threads for the match pre-pass of large inputs (only with PXA_THREADS). 0: number of cores (default).
+// 1: none -- e.g. when already compressing many carts at once. doesn't change output
+void pxa_set_threads(pxa_context *ctx, int threads)
+{
+	ctx->threads = threads;
+}
 
-static int getbit()
+void pxa_free_context(pxa_context *ctx)
 {
-	int ret;
-	
-	ret = (src_buf[src_pos] & bit) ? 1 : 0;
-	bit <<= 1;
-	if (bit == 256)
-	{
-		bit = 1;
-		src_pos ++;
-	}
-	return ret;
+	if (!ctx) return;
+	codo_free(ctx->hash_pos); // allocated on first compress
+	codo_free(ctx->key_start);
+	codo_free(ctx->key_rank);
+	codo_free(ctx->match);
+	mini_free_context(ctx->mctx);
+	codo_free(ctx);
 }
 
-void putbit(int bval)
+// :c: encoder context owned by ctx, created on first use and freed with it. used by
+// pico8_code_section_compress; callers with one pxa_context per thread can use it for
+// compress_mini too, instead of keeping their own
+mini_context *pxa_mini_context(pxa_context *ctx)
 {
-	dest_buf[dest_pos] &= ~bit; // 0.2.0j: per-bit
-	if (bval) dest_buf[dest_pos] |= bit;
+	if (!ctx->mctx) ctx->mctx = mini_create_context();
+	return ctx->mctx;
+}
 
-	bit <<= 1;
 
-	if (bit == 256)
-	{
-		bit = 1;
-		dest_pos ++;
-		byte = dest_buf[dest_pos]; // 0.2.0j: so that don't clobber existing bits (can overwrite at bit level)
-	}
+//-------------------------------------------------
+// pxa bit-level read/write help functions
+//-------------------------------------------------
+
+// dest NULL: count bits only (pxa_compressed_size). positions move the same, nothing is stored
+static void init_bit_writer(pxa_context *ctx, uint8 *dest)
+{
+	ctx->dest_buf = dest;
+	ctx->dest_pos = 0;
+	ctx->put_buf = 0;
+	ctx->put_count = 0;
 }
 
-static int getval(int bits)
+// write out a full 32-bit word of pending bits
+#define FLUSH_PUT_WORD(ctx) { \
+	uint8 *d = (ctx)->dest_buf + (ctx)->dest_pos; \
+	if ((ctx)->dest_buf) { d[0] = (ctx)->put_buf; d[1] = (ctx)->put_buf >> 8; d[2] = (ctx)->put_buf >> 16; d[3] = (ctx)->put_buf >> 24; } \
+	(ctx)->put_buf >>= 32; (ctx)->put_count -= 32; (ctx)->dest_pos += 4; }
+
+// write out all pending bits. last byte is partial when not aligned; pending bits stay in put_buf
+static void flush_bits(pxa_context *ctx)
 {
 	int i;
-	int val = 0;
-	if (bits == 0) return 0;
+	if (!ctx->dest_buf) return;
+	for (i = 0; i < ctx->put_count; i += 8)
+		ctx->dest_buf[ctx->dest_pos + i/8] = ctx->put_buf >> i;
+}
 
-	for (i = 0; i < bits; i++)
-		if (getbit())
-			val |= (1 << i);
+// 0.2.0j
+// write position as a bit offset from start of dest_buf
+static int get_write_pos(pxa_context *ctx)
+{
+	return ctx->dest_pos * 8 + ctx->put_count;
+}
 
-	return val;
+// rewind (or advance) to a bit offset. bits already written before that position are kept
+static void set_write_pos(pxa_context *ctx, int val)
+{
+	flush_bits(ctx);
+	ctx->dest_pos = val >> 3;
+	ctx->put_count = val & 7;
+	ctx->put_buf = 0;
+	if (ctx->put_count && ctx->dest_buf)
+		ctx->put_buf = ctx->dest_buf[ctx->dest_pos] & ((1 << ctx->put_count) - 1); // 0.2.0j: so that don't clobber existing bits (can overwrite at bit level)
 }
 
+// byte holding the next bit to be written
+#define WRITE_BYTE_POS(ctx) ((ctx)->dest_pos + ((ctx)->put_count >> 3))
 
-static int putval(int val, int bits)
+
+static int putval(pxa_context *ctx, int val, int bits)
 {
-	int i;
 	if (bits <= 0) return 0;
 
-	for (i = 0; i < bits; i++)
-		putbit(val & (1 << i));
+	ctx->put_buf |= (uint64)(val & ((1 << bits) - 1)) << ctx->put_count;
+	ctx->put_count += bits;
+
+	if (ctx->put_count >= 32)
+		FLUSH_PUT_WORD(ctx);
 
 	return bits;
 }
 
-static void putbitlen(int val)
+void putbit(pxa_context *ctx, int bval)
+{
+	putval(ctx, bval ? 1 : 0, 1);
+}
+
+// raw block data: 4 bytes per write
+static void putbytes(pxa_context *ctx, uint8 *src, int len)
+{
+	int k = 0;
+
+	for (; k + 4 <= len; k += 4)
+	{
+		ctx->put_buf |= ((uint64)src[k] | (uint64)src[k+1] << 8 | (uint64)src[k+2] << 16 | (uint64)src[k+3] << 24) << ctx->put_count;
+		ctx->put_count += 32;
+		FLUSH_PUT_WORD(ctx);
+	}
+
+	for (; k < len; k++)
+		putval(ctx, src[k], 8);
+}
+
+static void putbitlen(pxa_context *ctx, int val)
 {
 	int i;
 	for (i = 0; i < val-1; i++)
-		putbit(0);
-	putbit(1);
+		putbit(ctx, 0);
+	putbit(ctx, 1);
 }
 
 
-static int putchain(int val, int link_bits, int max_bits)
+static int putchain(pxa_context *ctx, int val, int link_bits, int max_bits)
 {
 	int i;
 	int max_link_val = (1 << link_bits) - 1; // 3 bits means can write < 7 in a single link
@@ -155,7 +289,7 @@ static int putchain(int val, int link_bits, int max_bits)
 	while (vv == max_link_val)
 	{
 		vv = MIN(val, max_link_val);
-		bits_written += putval(vv, link_bits);
+		bits_written += putval(ctx, vv, link_bits);
 		val -= vv;
 
 		if (bits_written >= max_bits) return bits_written; // next val is implicitly 0
@@ -163,33 +297,13 @@ static int putchain(int val, int link_bits, int max_bits)
 	return bits_written;
 }
 
-static int getchain(int link_bits, int max_bits)
-{
-	int i;
-	int max_link_val = (1 << link_bits) - 1;
-	int val = 0;	
-	int vv = max_link_val;
-	int bits_read = 0;
-
-	while (vv == max_link_val)
-	{
-		vv = getval(link_bits);
-		bits_read += link_bits;
-		val += vv;
-		if (bits_read >= max_bits) return val; // next val is implicitly 0
-	}
-	
-	return val;
-}
-
-
 /*
 	// used for block distance. reasonably even distribution of values, but more frequently closer.
 
 	// calc number of bits; write that first (steps of 2)
 	// then write val
 */
-static int putnum(int val)
+static int putnum(pxa_context *ctx, int val)
 {
 	int jump = BLOCK_DIST_BITS;
 	int bits = jump;
@@ -202,26 +316,95 @@ static int putnum(int val)
 	// 1  15 bits // more frequent so put first
 	// 01 10 bits
 	// 00  5 bits
-	putchain(3-(bits/jump), 1, 2);
+	putchain(ctx, 3-(bits/jump), 1, 2);
 
-	putval(val, bits);
+	putval(ctx, val, bits);
 	return (bits/jump)+bits;
 }
 
-static int getnum()
+
+//-------------------------------------------------
+// pxa decoder bit reader: 64 bits at a time
+//-------------------------------------------------
+
+static void init_bit_reader(pxa_context *ctx, uint8 *src, int pos, int len)
+{
+	ctx->src_buf = src;
+	ctx->src_pos = pos;
+	ctx->src_len = len;
+	ctx->bit_buf = 0;
+	ctx->bit_count = 0;
+}
+
+// top up bit_buf to at least 57 bits. bytes past src_len read as 0
+static void refill_bits(pxa_context *ctx)
+{
+	if (ctx->bit_count > 56) return;
+
+	if (ctx->src_pos + 8 <= ctx->src_len)
+	{
+		uint8 *p = ctx->src_buf + ctx->src_pos;
+		uint64 w =
+			(uint64)p[0]       | (uint64)p[1] << 8  | (uint64)p[2] << 16 | (uint64)p[3] << 24 |
+			(uint64)p[4] << 32 | (uint64)p[5] << 40 | (uint64)p[6] << 48 | (uint64)p[7] << 56;
+
+		// bits above bit_count are either zero or already hold these same bytes
+		ctx->bit_buf |= w << ctx->bit_count;
+		ctx->src_pos += (63 - ctx->bit_count) >> 3;
+		ctx->bit_count |= 56;
+	}
+	else
+	{
+		while (ctx->bit_count <= 56)
+		{
+			uint64 b = ctx->src_pos < ctx->src_len ? ctx->src_buf[ctx->src_pos] : 0;
+			ctx->bit_buf |= b << ctx->bit_count;
+			ctx->src_pos ++;
+			ctx->bit_count += 8;
+		}
+	}
+}
+
+// peek / skip: caller makes sure enough bits are buffered (refill_bits)
+#define PEEK_BITS(ctx, n) ((int)((ctx)->bit_buf & ((1ull << (n)) - 1)))
+#define SKIP_BITS(ctx, n) {(ctx)->bit_buf >>= (n); (ctx)->bit_count -= (n);}
+
+static int getbits(pxa_context *ctx, int bits)
 {
-	int jump = BLOCK_DIST_BITS;
-	int bits = jump;
-	int src_pos_0 = src_pos;
-	int bit_0 = bit;
 	int val;
+	refill_bits(ctx);
+	val = PEEK_BITS(ctx, bits);
+	SKIP_BITS(ctx, bits);
+	return val;
+}
 
-	// 1  15 bits // more frequent so put first
-	// 01 10 bits
-	// 00  5 bits
-	bits = (3 - getchain(1, 2)) * BLOCK_DIST_BITS;
+// position of byte holding the next unread bit
+static int get_read_pos(pxa_context *ctx)
+{
+	return (ctx->src_pos * 8 - ctx->bit_count) >> 3;
+}
+
+/*
+	block distance: 1 or 2 bit prefix (a 1-bit chain of max 2 links) gives number of bits
+
+	indexed by next 2 bits:
+		x0: 15 bits
+		01: 10 bits
+		11:  5 bits
+*/
+static const int num_prefix_bits[4] = {1, 2, 1, 2};
+static const int num_bits[4]        = {15, 10, 15, 5};
+
+static int getnum(pxa_context *ctx)
+{
+	int prefix, bits, val;
 
-	val = getval(bits);
+	refill_bits(ctx);
+	prefix = PEEK_BITS(ctx, 2);
+	SKIP_BITS(ctx, num_prefix_bits[prefix]);
+	bits = num_bits[prefix];
+	val = PEEK_BITS(ctx, bits);
+	SKIP_BITS(ctx, bits);
 
 	if (val == 0 && bits == 10)
 		return -1; // raw block marker
@@ -229,12 +412,65 @@ static int getnum()
 	return val;
 }
 
+// block length: chain of 3-bit links, read 3 links at a time
+static int getlenchain(pxa_context *ctx)
+{
+	int val = 0;
+	int entry;
+
+	do {
+		refill_bits(ctx);
+		entry = ctx->len_chain[PEEK_BITS(ctx, 3 * BLOCK_LEN_CHAIN_BITS)];
+		SKIP_BITS(ctx, entry >> 8);
+		val += entry & 0xff;
+	} while (entry == ((3 * BLOCK_LEN_CHAIN_BITS) << 8 | 21)); // all 3 links were 7: continue
+
+	return val;
+}
+
 // ---------------------
 
 
-#define PXA_WRITE_VAL(x) {literal_bits_written += putval(x,8);}
-#define PXA_READ_VAL(x)  getval(8)
-static int pxa_find_repeatable_block(uint8 *dat, int pos, int data_len, int *block_offset, int *score_out)
+#define PXA_WRITE_VAL(x) putval(ctx, x, 8)
+
+// first index in ascending list[0..n-1] with list[i] >= val (n if none)
+static int pxa_lower_bound(uint16 *list, int n, int val)
+{
+	int lo = 0, hi = n;
+
+	while (lo < hi)
+	{
+		int mid = (lo + hi) >> 1;
+		if (list[mid] < val)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+// ascending candidate positions for a match at pos (needs pos <= len-3). MINI_HASH list also holds
+// later positions and other trigrams that share the hash; callers cut at pos and check match length.
+static uint16 *pxa_candidates(pxa_context *ctx, uint8 *dat, int pos, int *list_len)
+{
+	int hash;
+
+	if (ctx->exact_index)
+	{
+		*list_len = ctx->key_rank[pos] - ctx->key_start[pos];
+		return ctx->hash_pos + ctx->key_start[pos];
+	}
+
+	hash = MINI_HASH(dat, pos);
+	*list_len = ctx->hash_start[hash + 1] - ctx->hash_start[hash];
+	return ctx->hash_pos + ctx->hash_start[hash];
+}
+
+// only reads input, hash index and search limits (so can run on many threads at once).
+// read_end: raised to cover input that the result depends on
+// give_up_len: return -1 (no result) on finding a match this long. 0: no limit
+static int pxa_find_repeatable_block(pxa_context *ctx, uint8 *dat, int pos, int data_len, int *block_offset, int *score_out, int *read_end, int give_up_len)
 {
 	int max_hist_len = 32767; // 15 bits -- super-dense carts are shorter
 	int i, j;
@@ -246,19 +482,27 @@ static int pxa_find_repeatable_block(uint8 *dat, int pos, int data_len, int *blo
 	int hash;
 	int last_pos;
 	int score, dist, bit_cost, best_score = -1;
-	int list_pos;
+	int list_pos, list_start, list_end;
 
 	p = &dat[pos];
 
 	// block length can't be longer than remaining
 	
-	if (max_len < PXA_MIN_BLOCK_LEN) return 0;
+	if (max_len < PXA_MIN_BLOCK_LEN)
+	{
+		*read_end = data_len + 1; // result depends on where input ends
+		return 0;
+	}
 	if (max_hist_len < PXA_MIN_BLOCK_LEN) return 0;
 	
+	// candidates depend on 3 bytes at pos (and earlier)
+	*read_end = MAX(*read_end, pos + PXA_MIN_BLOCK_LEN);
+
 	hash = MINI_HASH(dat, pos);
-	last_pos = found[hash]; // most recently found match. to do: could just calculate hash ranges at start. hash_first[] hash_last[].
+	last_pos = ctx->found[hash]; // most recently found match. to do: could just calculate hash ranges at start. hash_first[] hash_last[].
 
-	uint16 *list = hash_list[hash];
+	int list_len;
+	uint16 *list = pxa_candidates(ctx, dat, pos, &list_len);
 
 /*	
 	for (list_pos = 0; 
@@ -269,22 +513,30 @@ static int pxa_find_repeatable_block(uint8 *dat, int pos, int data_len, int *blo
 			list_pos++)
 */
 
-	if (!list) return 0; // 0.2.0e: exit early
-	for (list_pos = 0; list_pos < list[1] && list[2+list_pos] < pos; list_pos++) // 0.2.0e: can exit early if encounter future position (rest of list will also be)
-	if (list[2+list_pos] >= pos - max_hist_len) // not out of range   0.2.0e: moved here -- still want to try rest of list
+	if (list_len == 0) return 0; // 0.2.0e: exit early
+
+	// list is sorted: binary search for candidates in window [pos - max_hist_len, pos)
+	list_start = pxa_lower_bound(list, list_len, pos - max_hist_len);
+	list_end   = pxa_lower_bound(list, list_len, pos);
+
+	if (ctx->max_chain > 0)
+		list_start = MAX(list_start, list_end - ctx->max_chain); // only try most recent
+
+	// closest first, so that nice_len can stop early. ties go to the earlier position
+	// (score >= best_score), same as 0.2.4c's scan from oldest with score > best_score
+	for (list_pos = list_end - 1; list_pos >= list_start; list_pos--)
 	{
-		int pos0 = list[2 + list_pos];
+		int pos0 = list[list_pos];
 
-		// test starting from pos0 + 0
-		i = 0;
+		// matches in history, then in output of this repeated block
+		// (was dat[pos0 + (i % (pos-pos0))] past pos: same bytes as dat[pos0 + i] while matching)
+		i = p8_match_len(&dat[pos0], &dat[pos], max_len);
 
-		// matches in history
-		while (i < max_len && (pos0+i) < pos && dat[pos0 + i] == dat[pos + i])
-			i ++;
+		if (give_up_len > 0 && i >= give_up_len)
+			return -1;
 
-		// matches in output of this repeated block
-		while (i < max_len && (pos0+i) >= pos && dat[pos0 + (i % (pos-pos0))] == dat[pos + i])
-			i ++;
+		// compared up to first mismatch (or end of input)
+		*read_end = MAX(*read_end, pos + i + 1);
 
 		// distance cost
 
@@ -311,13 +563,15 @@ static int pxa_find_repeatable_block(uint8 *dat, int pos, int data_len, int *blo
 
 		score = i * 256 / bit_cost; // number of characters written / cost
 
-		if (score > best_score)
+		if (score >= best_score)
 		{
 			best_score = score;
 			best_pos0 = pos0;
 			best_len = i;
 		}
-	
+
+		if (ctx->nice_len > 0 && i >= ctx->nice_len)
+			break;
 	}
 	
 	//printf("@@ pos: %d offset: %d len: %d\n", pos, (pos - best_pos0), best_len);
@@ -333,254 +587,752 @@ static int pxa_find_repeatable_block(uint8 *dat, int pos, int data_len, int *blo
 }
 
 
-// debug stats
-static int block_bits_written = 0;
-static int literal_bits_written = 0;
-static int total_block_len = 0;
-static int num_blocks, num_blocks_large, num_literals;
+//-------------------------------------------------
+// match pre-pass
+//-------------------------------------------------
+
+// pxa_find_repeatable_block doesn't depend on encoder state, so with PXA_THREADS, matches for large
+// inputs are found on worker threads before the serial emit loop. workers follow their own greedy
+// parse through each chunk, so most positions they skip are skipped by the encoder too; positions
+// the encoder does land on that weren't searched are searched then. same output either way.
+// workers leave very long matches to the encoder: on runs, searching a position that the encoder
+// skips over can cost more than the whole encode.
 
+#define PXA_PREPASS_MIN_LEN  8192 // shorter input: starting threads costs more than it saves
+#define PXA_PREPASS_CHUNK    2048
+#define PXA_PREPASS_GIVE_UP_LEN 256
+#define PXA_PREPASS_MAX_THREADS 16
 
-static void init_literals_state(int *literal, int *literal_pos)
+typedef struct pxa_match
 {
-	int i;
+	int len; // -1: not searched
+	int offset, score;
+	int read_end;
+} pxa_match;
 
-	// starting state makes little difference
-	// using 255-i (which seems terrible) only costs 10 bytes more.
+// match at pos: from pre-pass when it was searched there
+static int pxa_match_at(pxa_context *ctx, uint8 *dat, int pos, int data_len, int *block_offset, int *score_out)
+{
+	pxa_match *m;
 
-	for (i = 0; i < 256; i++)
-		literal[i] = i;
+	if (!ctx->use_match || pos >= data_len || ctx->match[pos].len < 0)
+		return pxa_find_repeatable_block(ctx, dat, pos, data_len, block_offset, score_out, &ctx->read_end, 0);
 
-	for (i = 0; i < 256; i++)
-		literal_pos[literal[i]] = i;
+	m = &ctx->match[pos];
+	*block_offset = m->offset;
+	*score_out = m->score;
+	ctx->read_end = MAX(ctx->read_end, m->read_end);
+
+	return m->len;
 }
 
+#ifdef PXA_THREADS
 
-// pxa_build_hash_lookup: lists of occurances of hashes
-// maybe better to just do 2 passes (calculate lengths on first pass) but this works fine.
-// re-allocate lists into a fixed pool as they grow
-void pxa_build_hash_lookup(uint8 *in, int len)
+typedef struct
 {
-	int i;
-	int hash;
-	uint16 *list;
-	uint16 *new_list;
-
-	// printf("building hash lookup\n");
-
-	memset(hash_list, 0, sizeof(hash_list));
+	pxa_context *ctx;
+	uint8 *in;
+	int len, lookahead;
+	int next; // start of next chunk (under lock)
+	pthread_mutex_t lock;
+} pxa_prepass;
 
-/*
-	512k to build lookup:
-		worst case is evenly allocated lists (most list overhead)
-		-> list len 10 (16 allocated) * 8192 = ~80,000 to house 64k position indexes
-		-> allocated at 4,8,16, so 8192 * 3 overhead + 8192 * 28 =   ~ 8192 * 32 uint16's = 262144
-			// maximum oberved is white_ale_in_benin: 125478, so agrees.
-*/
+static void pxa_prepass_search(pxa_prepass *pp, int pos)
+{
+	pxa_match *m = &pp->ctx->match[pos];
 
-	int heap_size = 262144 * sizeof(uint16);
+	m->offset = 0;
+	m->score = -1;
+	m->read_end = 0;
+	m->len = pxa_find_repeatable_block(pp->ctx, pp->in, pos, pp->len, &m->offset, &m->score, &m->read_end, PXA_PREPASS_GIVE_UP_LEN);
+}
 
-	// max hash size: 
-	if (!hash_heap)
-		hash_heap = malloc(heap_size);
-	memset(hash_heap, 0, heap_size);
+static void *pxa_prepass_main(void *arg)
+{
+	pxa_prepass *pp = arg;
+	int start, end, pos, i;
 
-	int heap_pos = 0;
-	
-	for (i = 0; i < len-2; i++)
+	for (;;)
 	{
-		hash = MINI_HASH(in, i);
+		pthread_mutex_lock(&pp->lock);
+		start = pp->next;
+		pp->next += PXA_PREPASS_CHUNK;
+		pthread_mutex_unlock(&pp->lock);
 
-		list = hash_list[hash];
+		if (start >= pp->len) break;
+		end = MIN(start + PXA_PREPASS_CHUNK, pp->len);
 
-		// new list		
-		if (!list){
-			// printf("new list at %d\n", heap_pos);
-			hash_list[hash] = &hash_heap[heap_pos];
-			list = hash_list[hash];
-			list[0] = 4; // allocated
-			list[1] = 0; // items
-			heap_pos += 2 + list[0];
-		}
+		for (pos = start; pos < end; pos++)
+			pp->ctx->match[pos].len = -1;
 
-		// grow list if full
-		if (list[0] == list[1])
+		for (pos = start; pos < end; )
 		{
-			// printf("grow list to %d  (size: %d)\n", heap_pos, list[0] * 2);
-			hash_list[hash] = &hash_heap[heap_pos];
-			new_list = hash_list[hash];
-
-			new_list[0] = list[0] * 2; // double allocation. means can never exceed *2 memory consumption of final list in total
-			new_list[1] = list[1];     // items
-			memcpy(&new_list[2], &list[2], list[1] * sizeof(uint16)); // copy existing items
-			list = new_list;
-			heap_pos += 2 + list[0];
+			pxa_prepass_search(pp, pos);
+
+			if (pp->ctx->match[pos].len < 0)
+			{
+				// long match: encoder searches it (if it lands here)
+				pos += PXA_PREPASS_GIVE_UP_LEN;
+				continue;
+			}
+
+			if (pp->ctx->match[pos].len < PXA_MIN_BLOCK_LEN)
+			{
+				pos ++;
+				continue;
+			}
+
+			// positions the encoder looks ahead to before taking a weak block
+			if (pp->lookahead && pp->ctx->match[pos].score < 128)
+				for (i = 1; i < 3 && pos + i < end; i++)
+					pxa_prepass_search(pp, pos + i);
+
+			pos += pp->ctx->match[pos].len;
 		}
-		
-		list[2 + list[1]] = i;
-		list[1] ++;
 	}
+
+	return NULL;
 }
 
+// search input from pos to len on ctx->threads threads (this one included). returns 1 if done
+static int pxa_prepass_run(pxa_context *ctx, uint8 *in, int pos, int len, int level)
+{
+	pxa_prepass pp;
+	pthread_t thread[PXA_PREPASS_MAX_THREADS];
+	int i, started, num = ctx->threads > 0 ? ctx->threads : sysconf(_SC_NPROCESSORS_ONLN);
 
-#define BACKUP_VLIST_STATE()  memcpy(literal_backup, literal, sizeof(literal));  memcpy(literal_pos_backup, literal_pos, sizeof(literal_pos));
-#define RESTORE_VLIST_STATE() memcpy(literal, literal_backup, sizeof(literal));  memcpy(literal_pos, literal_pos_backup, sizeof(literal_pos));
+	num = MIN(num, PXA_PREPASS_MAX_THREADS);
+	num = MIN(num, (len - pos + PXA_PREPASS_CHUNK - 1) / PXA_PREPASS_CHUNK);
+	if (num < 2 || len - pos < PXA_PREPASS_MIN_LEN) return 0;
 
+	if (len > ctx->match_size)
+	{
+		codo_free(ctx->match);
+		ctx->match = codo_malloc(len * sizeof(pxa_match));
+		ctx->match_size = len;
+	}
 
-int pxa_compress(uint8 *in_p, uint8 *out, int len)
-{
-	int pos = 0;
-	int block_offset;
-	int block_len;
-	int i, j, best_i;
-	uint8 *in;
-	char *modified_code;
-	int hash;
-	int block_score, literal_score;
-	int literal[256];
-	int literal_pos[256];
-	int literal_backup[256];
-	int literal_pos_backup[256];
+	pp.ctx = ctx;
+	pp.in = in;
+	pp.len = len;
+	pp.lookahead = level != PXA_LEVEL_FAST;
+	pp.next = pos;
+	pthread_mutex_init(&pp.lock, NULL);
 
-	// 0.2.0j
-	int raw_pos_src0 = 0;
-	int raw_header_write_pos = 0;
-	int raw_block_write_pos = 0;
-	int raw_pos_src = 0;
-	int raw_pos_dest = 0;
-	int stored_last_segment_as_raw = 0;
-	int raw_block_size = 0;
-	
+	for (started = 0; started < num - 1; started++)
+		if (pthread_create(&thread[started], NULL, pxa_prepass_main, &pp)) break;
 
-	init_literals_state(literal, literal_pos);
-	pxa_build_hash_lookup(in_p, len);
+	pxa_prepass_main(&pp);
 
-	bit = 1;
-	byte = 0;
-	dest_buf = out;
-	dest_pos = 0;
+	for (i = 0; i < started; i++)
+		pthread_join(thread[i], NULL);
 
-	if (len == 0) return 0;
-	
-	for (i = 0; i < HASH_MAX; i++)
-		found[i] = -1;
-	
-	modified_code = codo_malloc(len);
-	memcpy(modified_code, in_p, len);
-	in = modified_code;
+	pthread_mutex_destroy(&pp.lock);
+	return 1;
+}
 
-	
-	// appear empty in old versions of pico-8 (not relevant anymore)
-	PXA_WRITE_VAL(0);
-	PXA_WRITE_VAL('p');
-	PXA_WRITE_VAL('x');
-	PXA_WRITE_VAL('a');
-	
-	// write uncompressed size (plain uint32 so that easy to read & allocate dest before calling)
-	PXA_WRITE_VAL(len/256);
-	PXA_WRITE_VAL(len%256);
+#endif
 
-	// compressed size (fill in later). used for robust/safe decompression
-	PXA_WRITE_VAL(0);
-	PXA_WRITE_VAL(0);
 
-	num_blocks = 0;
-	num_literals = 0;
-	num_blocks_large = 0;
+// literal list (vlist): move-to-front order of byte values. 256 bytes, so that finding
+// a value (memchr) and shifting the list (memmove) are a few vector ops instead of a
+// loop over lpos entries (that also had to update a separate positions table).
 
-	// start looking for raw blocks
-	raw_pos_dest = dest_pos;
-	raw_pos_src = raw_pos_src0 = pos;
-	raw_header_write_pos = get_write_pos();
-	raw_block_write_pos = get_write_pos();
-	BACKUP_VLIST_STATE();
+static void init_literals_state(uint8 *literal)
+{
+	int i;
 
+	// starting state makes little difference
+	// using 255-i (which seems terrible) only costs 10 bytes more.
 
-	while (pos < len)
-	{
-		// either copy or literal
-		
-		block_len = pxa_find_repeatable_block(in, pos, len, &block_offset, &block_score);
+	for (i = 0; i < 256; i++)
+		literal[i] = i;
+}
+
+#define LITERAL_POS(literal, c) ((int)((uint8 *)memchr(literal, c, 256) - (literal)))
+
+// move literal[lpos] to start of list
+static void literal_to_front(uint8 *literal, int lpos)
+{
+	int c = literal[lpos];
+	memmove(literal + 1, literal, lpos);
+	literal[0] = c;
+}
 
-		
-		int c = in[pos];
-		int lpos = literal_pos[c];
 
-		// score: start from 2+ for top-level literal marker + category marker (1,2,2 bits)
+// exact index: hash_pos sorted by trigram, then position. radix sort of positions on 12 bits of
+// the key at a time (stable, so positions stay ascending within each key), then mark runs.
+static void pxa_build_trigram_index(pxa_context *ctx, uint8 *in, int num)
+{
+	int *count = ctx->hash_start; // HASH_MAX+1 entries: enough for 12-bit digits
+	uint16 *tmp = ctx->key_start; // first pass output (overwritten by key_start below)
+	int i, k = 0, shift;
 
-		int cat_bits = TINY_LITERAL_BITS;
-		int cat_max_val = 1 << cat_bits;
-		while (lpos >= cat_max_val)
+	for (shift = 0; shift < 24; shift += 12)
+	{
+		uint16 *dest = shift ? ctx->hash_pos : tmp;
+
+		memset(count, 0, sizeof(ctx->hash_start));
+		for (i = 0; i < num; i++)
+			count[((TRIGRAM(in, i) >> shift) & (HASH_MAX-1)) + 1] ++;
+		for (i = 0; i < HASH_MAX; i++)
+			count[i + 1] += count[i];
+		for (i = 0; i < num; i++)
 		{
-			cat_bits ++;
-			cat_max_val += (1 << cat_bits);
-			//printf(" cat_max_val %d   cat_bits: %d \n", cat_max_val, cat_bits);
+			int p = shift ? tmp[i] : i;
+			dest[count[(TRIGRAM(in, p) >> shift) & (HASH_MAX-1)] ++] = p;
 		}
+	}
 
-		// is correct
-		//printf("lpos bit cost: %d %d (cat_max_val: %d)\n", lpos, (2 + ((MIN(8,cat_bits) - TINY_LITERAL_BITS) + cat_bits)), cat_max_val);
+	for (i = 0; i < num; i++)
+	{
+		int p = ctx->hash_pos[i];
+		if (i > 0 && TRIGRAM(in, ctx->hash_pos[i-1]) != TRIGRAM(in, p))
+			k = i;
+		ctx->key_start[p] = k;
+		ctx->key_rank[p] = i;
+	}
+}
 
-		literal_score = 1 * 256 / (2 + ((cat_bits - TINY_LITERAL_BITS) + cat_bits));
-		
-/*
-		if (block_len >= PXA_MIN_BLOCK_LEN && block_score > literal_score)
-			printf("block score: %04d   literal score: %04d %c\n", block_score, literal_score, block_score >= 128 ? '*' : ' ');
-*/
+// pxa_build_hash_lookup: positions of each hash, in one array sorted by hash (then position).
+// counting sort: count each hash, prefix sum to get start of each run, then fill.
+// exactly len-2 entries, and each hash's positions are contiguous for scanning.
+void pxa_build_hash_lookup(pxa_context *ctx, uint8 *in, int len)
+{
+	int *start = ctx->hash_start;
+	int num = MAX(0, len - 2);
+	int i;
 
-		// If block score is good (>= 128), just take it. But otherwise, look for better block score in next 2 characters
-		// before commiting to a block. Saves ~400 bytes for heavy carts (!)
+	if (num > ctx->hash_pos_size)
+	{
+		codo_free(ctx->hash_pos);
+		ctx->hash_pos = codo_malloc(num * sizeof(uint16));
+		ctx->hash_pos_size = num;
+	}
 
-		if (block_len >= PXA_MIN_BLOCK_LEN && block_score > literal_score)
-		if (block_score < 128) // 25% faster, only slight drop in compression ratio (lost avg 3.6 bytes across 5 carts)
+	if (ctx->exact_index)
+	{
+		if (num > ctx->key_size)
 		{
-			int ii;
-			for (ii =1; ii < 3; ii++)
-			{
-				int block_offset2=0;
-				int block_score2=0;
-			
-				pxa_find_repeatable_block(in, pos+ii, len, &block_offset2, &block_score2);
-				if (block_score2 > block_score * 6/5) // 6/5
-				{
-					// printf("blocked! block_score2: %d block_score %d\n", block_score2, block_score);
-					block_score = 0;
-					break;
-				}
-			}
+			codo_free(ctx->key_start);
+			codo_free(ctx->key_rank);
+			ctx->key_start = codo_malloc(num * sizeof(uint16));
+			ctx->key_rank  = codo_malloc(num * sizeof(uint16));
+			ctx->key_size = num;
 		}
+		pxa_build_trigram_index(ctx, in, num);
+		return;
+	}
 
+	// count into start[hash+1]
+	memset(start, 0, sizeof(ctx->hash_start));
+	for (i = 0; i < num; i++)
+		start[MINI_HASH(in, i) + 1] ++;
 
-		if (block_len >= PXA_MIN_BLOCK_LEN && block_score > literal_score)
-		{
-			// block
-			//printf("*");
-
+	for (i = 0; i < HASH_MAX; i++)
+		start[i + 1] += start[i];
 
-			// makes sense to mark with block because aim for ~ 50% blocks
-			putbit(0); block_bits_written ++;
+	// fill, using start[hash] as write cursor. afterwards start[hash] is end of its run (start of next)
+	for (i = 0; i < num; i++)
+		ctx->hash_pos[start[MINI_HASH(in, i)] ++] = i;
 
+	for (i = HASH_MAX; i > 0; i--)
+		start[i] = start[i - 1];
+	start[0] = 0;
+}
 
-			// printf(" writing block offset:%d len:%d\n", block_offset, block_len);
-			
-			block_bits_written += putnum(block_offset - 1);
-			block_bits_written += putchain(block_len-PXA_MIN_BLOCK_LEN, BLOCK_LEN_CHAIN_BITS, 100000);
 
-			if (block_len-PXA_MIN_BLOCK_LEN >= 7){
-				num_blocks_large ++;
-			}
+#define BACKUP_VLIST_STATE()  memcpy(literal_backup, literal, sizeof(literal));
+#define RESTORE_VLIST_STATE() memcpy(literal, literal_backup, sizeof(literal));
 
-			pos += block_len;
-			
-			// stats
-			num_blocks ++;
-			total_block_len += block_len;
-		}
-		else
-		{
-			// literal
 
-			putbit(1);
+//-------------------------------------------------
+// optimal parse
+//
+// forward dynamic program over exact bit prices, one window of input at a time.
+// each position keeps the literal (move-to-front) list of the cheapest path that
+// reaches it, so literal prices use the real list position on that path.
+// windows are parsed just before they are written, so each one starts from the
+// encoder's actual literal list.
+//-------------------------------------------------
 
-			// write category
+#define PXA_OPT_WINDOW   8192
+#define PXA_OPT_NICE_LEN 64 // longer matches: stop searching, only try full length and skip over it
+#define PXA_OPT_INF      0x7fffffff
+
+typedef struct
+{
+	int start;   // input position of window[0]
+	int end;     // input position after window
+	int cost[PXA_OPT_WINDOW + 1];
+	int from_len[PXA_OPT_WINDOW + 1];    // length of edge arriving at node (1: literal)
+	int from_offset[PXA_OPT_WINDOW + 1];
+	int path_len[PXA_OPT_WINDOW];        // chosen path: length of edge leaving node
+	int path_offset[PXA_OPT_WINDOW];
+	uint8 vlist[PXA_OPT_WINDOW + 1][256]; // literal list at node, for cheapest path
+} pxa_parse;
+
+// bits to write literal at lpos: marker + category chain (n+1) + index (TINY_LITERAL_BITS+n)
+static int literal_price(int lpos)
+{
+	int n = 0;
+	int cat_max_val = 1 << TINY_LITERAL_BITS;
+
+	while (lpos >= cat_max_val)
+	{
+		n ++;
+		cat_max_val += 1 << (TINY_LITERAL_BITS + n);
+	}
+
+	return 1 + (n + 1) + (TINY_LITERAL_BITS + n);
+}
+
+// bits to write block: marker + putnum(offset-1) + putchain(len-PXA_MIN_BLOCK_LEN)
+static const int offset_class_price[3] = {2 + 5, 2 + 10, 1 + 15};
+
+static int offset_class(int offset)
+{
+	if (offset - 1 < (1 << BLOCK_DIST_BITS)) return 0;
+	if (offset - 1 < (1 << (BLOCK_DIST_BITS * 2))) return 1;
+	return 2;
+}
+
+static int block_price(int offset_cls, int len)
+{
+	int max_link_val = (1 << BLOCK_LEN_CHAIN_BITS) - 1;
+	return 1 + offset_class_price[offset_cls] + ((len - PXA_MIN_BLOCK_LEN) / max_link_val + 1) * BLOCK_LEN_CHAIN_BITS;
+}
+
+// longest match (and closest, for equal length) in each offset class, up to max_len
+// returns longest found
+static int pxa_find_matches(pxa_context *ctx, uint8 *dat, int pos, int max_len, int *match_len, int *match_offset)
+{
+	int max_hist_len = 32767;
+	int list_pos, list_start, list_len, i, c;
+	int best_len = 0;
+	uint16 *list;
+
+	for (c = 0; c < 3; c++)
+		match_len[c] = match_offset[c] = 0;
+
+	if (max_len < PXA_MIN_BLOCK_LEN) return 0;
+
+	list = pxa_candidates(ctx, dat, pos, &list_len);
+
+	// window, then walk back from closest (cheapest)
+	list_start = pxa_lower_bound(list, list_len, pos - max_hist_len);
+	list_pos   = pxa_lower_bound(list, list_len, pos) - 1;
+
+	if (ctx->max_chain > 0)
+		list_start = MAX(list_start, list_pos + 1 - ctx->max_chain);
+
+	for (; list_pos >= list_start; list_pos--)
+	{
+		int pos0 = list[list_pos];
+
+		i = p8_match_len(&dat[pos0], &dat[pos], max_len);
+
+		c = offset_class(pos - pos0);
+		if (i > match_len[c])
+		{
+			match_len[c] = i;
+			match_offset[c] = pos - pos0;
+		}
+
+		best_len = MAX(best_len, i);
+		if ((ctx->nice_len > 0 && best_len >= ctx->nice_len) || best_len == max_len)
+			break; // good enough; anything further back costs more
+	}
+
+	return best_len;
+}
+
+// parse in[start..] up to the end of the window. literal: initial literal list
+static void pxa_parse_window(pxa_context *ctx, pxa_parse *parse, uint8 *in, int start, int len, uint8 *literal)
+{
+	int end = MIN(len, start + PXA_OPT_WINDOW);
+	int n = end - start;
+	int k, c, l;
+	int match_len[3], match_offset[3];
+	int skip_to = 0;
+
+	parse->start = start;
+	parse->end = end;
+
+	for (k = 0; k <= n; k++)
+		parse->cost[k] = PXA_OPT_INF;
+	parse->cost[0] = 0;
+
+	memcpy(parse->vlist[0], literal, 256);
+
+	for (k = 0; k < n; k++)
+	{
+		int pos = start + k;
+		int cost = parse->cost[k];
+		int covered = PXA_MIN_BLOCK_LEN - 1; // lengths already offered by a cheaper offset class
+		uint8 *vlist = parse->vlist[k];
+
+		// literal list at this node: from the edge that reached it
+		if (k > 0)
+		{
+			memcpy(vlist, parse->vlist[k - parse->from_len[k]], 256);
+			if (parse->from_len[k] == 1)
+				literal_to_front(vlist, LITERAL_POS(vlist, in[pos - 1]));
+		}
+
+		// literal
+		l = literal_price(LITERAL_POS(vlist, in[pos]));
+		if (cost + l < parse->cost[k + 1])
+		{
+			parse->cost[k + 1] = cost + l;
+			parse->from_len[k + 1] = 1;
+		}
+
+		// inside a long match: don't branch from here
+		if (k < skip_to)
+			continue;
+
+		// blocks (can't cross end of window)
+		if (pxa_find_matches(ctx, in, pos, n - k, match_len, match_offset) >= PXA_OPT_NICE_LEN)
+			skip_to = k + MAX(match_len[0], MAX(match_len[1], match_len[2]));
+
+		for (c = 0; c < 3; c++)
+		{
+			int max_len = match_len[c];
+			int last = MIN(max_len, PXA_OPT_NICE_LEN);
+
+			for (l = covered + 1; l <= max_len; l++)
+			{
+				int new_cost;
+
+				if (l > last && l < max_len) l = max_len;
+
+				new_cost = cost + block_price(c, l);
+				if (new_cost < parse->cost[k + l])
+				{
+					parse->cost[k + l] = new_cost;
+					parse->from_len[k + l] = l;
+					parse->from_offset[k + l] = match_offset[c];
+				}
+			}
+
+			covered = MAX(covered, max_len);
+		}
+	}
+
+	// walk back from end to find path
+	for (k = n; k > 0; k -= l)
+	{
+		l = parse->from_len[k];
+		parse->path_len[k - l] = l;
+		parse->path_offset[k - l] = parse->from_offset[k];
+	}
+
+	// block cut short by end of window: let it run on (next window starts after it)
+	k = n - parse->from_len[n];
+	l = parse->path_len[k];
+	if (l >= PXA_MIN_BLOCK_LEN)
+	{
+		int pos0 = start + k - parse->path_offset[k];
+
+		while (start + k + l < len && in[pos0 + l] == in[start + k + l])
+			l ++;
+
+		parse->path_len[k] = l;
+		parse->end = start + k + l;
+	}
+}
+
+
+static int pxa_log2(int val)
+{
+	int n = 0;
+	while (val >>= 1) n++;
+	return n;
+}
+
+// search limits and index type for level
+static void pxa_set_level(pxa_context *ctx, int level)
+{
+	ctx->max_chain = level == PXA_LEVEL_FAST ? PXA_FAST_MAX_CHAIN : level == PXA_LEVEL_MAX ? PXA_MAX_MAX_CHAIN : 0;
+	ctx->nice_len  = level == PXA_LEVEL_FAST ? PXA_FAST_NICE_LEN  : level == PXA_LEVEL_MAX ? PXA_OPT_NICE_LEN  : 0;
+	if (ctx->user_max_chain > 0) ctx->max_chain = ctx->user_max_chain;
+	if (ctx->user_nice_len > 0)  ctx->nice_len  = ctx->user_nice_len;
+
+	// default level keeps MINI_HASH lists: collisions are scored by lookahead, so output depends on them
+	ctx->exact_index = level != PXA_LEVEL_DEFAULT;
+}
+
+// incremental recompression state (see pxa_compress_incremental)
+// checkpoints are taken where the raw block check keeps output as it is: bits before that are never
+// rewritten, and the rest of the encoder state is just input position and literal list.
+typedef struct
+{
+	int pos, write_pos;
+	int read_end;       // decisions before pos only looked at input before this
+	uint8 literal[256];
+} pxa_checkpoint;
+
+struct pxa_incremental
+{
+	uint8 *in, *out;    // input and encoder output (before raw fallback) of last compress
+	int in_len, in_size, out_size;
+	int bytes_written;
+	int level, max_chain, nice_len;
+	int count_only;     // last call was for size only: out holds nothing
+	pxa_checkpoint *checkpoint;
+	int num_checkpoints, max_checkpoints;
+};
+
+static void pxa_add_checkpoint(pxa_incremental *inc, int pos, int write_pos, int read_end, uint8 *literal)
+{
+	pxa_checkpoint *cp;
+
+	if (inc->num_checkpoints == inc->max_checkpoints)
+	{
+		int n = MAX(64, inc->max_checkpoints * 2);
+		cp = codo_malloc(n * sizeof(pxa_checkpoint));
+		if (inc->checkpoint)
+		{
+			memcpy(cp, inc->checkpoint, inc->num_checkpoints * sizeof(pxa_checkpoint));
+			codo_free(inc->checkpoint);
+		}
+		inc->checkpoint = cp;
+		inc->max_checkpoints = n;
+	}
+
+	cp = &inc->checkpoint[inc->num_checkpoints++];
+	cp->pos = pos;
+	cp->write_pos = write_pos;
+	cp->read_end = read_end;
+	memcpy(cp->literal, literal, 256);
+}
+
+// writes to dest; result (compressed, or input when larger) goes to out (can be same as dest).
+// inc: record checkpoints, and resume from the last one if there are any.
+// returns -1 if len > CODE_MAX_LEN (doesn't fit in header)
+static int pxa_encode(pxa_context *ctx, uint8 *in_p, uint8 *dest, uint8 *out, int len, int level, pxa_stats *stats, pxa_incremental *inc)
+{
+	int pos = 0;
+	int block_offset;
+	int block_len;
+	int i, j, best_i;
+	uint8 *in = in_p;
+	int hash;
+	int block_score, literal_score;
+	uint8 literal[256];
+	uint8 literal_backup[256];
+
+	// 0.2.0j
+	int raw_pos_src0 = 0;
+	int raw_header_write_pos = 0;
+	int raw_block_write_pos = 0;
+	int raw_pos_src = 0;
+	int raw_pos_dest = 0;
+	int stored_last_segment_as_raw = 0;
+	int raw_block_size = 0;
+
+	pxa_parse *parse = NULL;
+
+	// stats
+	pxa_stats stats_backup; // at start of segment that might be rewritten as raw
+	int raw_rewrites = 0;
+	double t_start = 0, t0 = 0, hash_time = 0, search_time = 0;
+	int bits; // write position at start of token
+
+	if (len > CODE_MAX_LEN) return -1;
+
+	if (stats)
+	{
+		memset(stats, 0, sizeof(pxa_stats));
+		t_start = p8_time();
+	}
+
+	init_literals_state(literal);
+	pxa_set_level(ctx, level);
+	pxa_build_hash_lookup(ctx, in_p, len);
+
+	if (stats)
+		hash_time = p8_time() - t_start;
+
+	init_bit_writer(ctx, dest);
+
+	if (len == 0) return 0;
+	
+	for (i = 0; i < HASH_MAX; i++)
+		ctx->found[i] = -1;
+	
+	if (level == PXA_LEVEL_MAX && inc)
+		inc->num_checkpoints = 0; // window parse looks too far ahead; always from start
+
+	if (inc && inc->num_checkpoints > 0)
+	{
+		// continue from checkpoint (output before it is unchanged)
+		pxa_checkpoint *cp = &inc->checkpoint[inc->num_checkpoints - 1];
+		pos = cp->pos;
+		memcpy(literal, cp->literal, sizeof(literal));
+		set_write_pos(ctx, cp->write_pos);
+		ctx->read_end = cp->read_end;
+
+		if (dest)
+		{
+			dest[4] = len/256;
+			dest[5] = len%256;
+		}
+	}
+	else
+	{
+		// appear empty in old versions of pico-8 (not relevant anymore)
+		PXA_WRITE_VAL(0);
+		PXA_WRITE_VAL('p');
+		PXA_WRITE_VAL('x');
+		PXA_WRITE_VAL('a');
+		
+		// write uncompressed size (plain uint32 so that easy to read & allocate dest before calling)
+		PXA_WRITE_VAL(len/256);
+		PXA_WRITE_VAL(len%256);
+
+		// compressed size (fill in later). used for robust/safe decompression
+		PXA_WRITE_VAL(0);
+		PXA_WRITE_VAL(0);
+
+		ctx->read_end = 0;
+		if (inc && level != PXA_LEVEL_MAX)
+			pxa_add_checkpoint(inc, pos, get_write_pos(ctx), 0, literal);
+	}
+
+	// start looking for raw blocks
+	raw_pos_dest = WRITE_BYTE_POS(ctx);
+	raw_pos_src = raw_pos_src0 = pos;
+	raw_header_write_pos = get_write_pos(ctx);
+	raw_block_write_pos = get_write_pos(ctx);
+	BACKUP_VLIST_STATE();
+	if (stats) stats_backup = *stats;
+
+	if (level == PXA_LEVEL_MAX)
+	{
+		parse = codo_malloc(sizeof(pxa_parse));
+		parse->end = 0;
+	}
+
+	if (stats) t0 = p8_time();
+
+	ctx->use_match = 0;
+#ifdef PXA_THREADS
+	if (!parse)
+		ctx->use_match = pxa_prepass_run(ctx, in, pos, len, level);
+#endif
+
+	if (stats) search_time += p8_time() - t0;
+
+	while (pos < len)
+	{
+		// either copy or literal
+
+		int c = in[pos];
+		int lpos = LITERAL_POS(literal, c);
+
+		if (stats) t0 = p8_time();
+
+		if (parse)
+		{
+			// optimal: parse next window when reach it
+			if (pos >= parse->end)
+				pxa_parse_window(ctx, parse, in, pos, len, literal);
+
+			block_len    = parse->path_len[pos - parse->start];
+			block_offset = parse->path_offset[pos - parse->start];
+		}
+		else
+		{
+			block_len = pxa_match_at(ctx, in, pos, len, &block_offset, &block_score);
+
+			// score: start from 2+ for top-level literal marker + category marker (1,2,2 bits)
+
+			int cat_bits = TINY_LITERAL_BITS;
+			int cat_max_val = 1 << cat_bits;
+			while (lpos >= cat_max_val)
+			{
+				cat_bits ++;
+				cat_max_val += (1 << cat_bits);
+				//printf(" cat_max_val %d   cat_bits: %d \n", cat_max_val, cat_bits);
+			}
+
+			// is correct
+			//printf("lpos bit cost: %d %d (cat_max_val: %d)\n", lpos, (2 + ((MIN(8,cat_bits) - TINY_LITERAL_BITS) + cat_bits)), cat_max_val);
+
+			literal_score = 1 * 256 / (2 + ((cat_bits - TINY_LITERAL_BITS) + cat_bits));
+		
+	/*
+			if (block_len >= PXA_MIN_BLOCK_LEN && block_score > literal_score)
+				printf("block score: %04d   literal score: %04d %c\n", block_score, literal_score, block_score >= 128 ? '*' : ' ');
+	*/
+
+			// If block score is good (>= 128), just take it. But otherwise, look for better block score in next 2 characters
+			// before commiting to a block. Saves ~400 bytes for heavy carts (!)
+
+			if (block_len >= PXA_MIN_BLOCK_LEN && block_score > literal_score)
+			if (block_score < 128) // 25% faster, only slight drop in compression ratio (lost avg 3.6 bytes across 5 carts)
+			if (level != PXA_LEVEL_FAST)
+			{
+				int ii;
+				for (ii =1; ii < 3; ii++)
+				{
+					int block_offset2=0;
+					int block_score2=0;
+			
+					pxa_match_at(ctx, in, pos+ii, len, &block_offset2, &block_score2);
+					if (block_score2 > block_score * 6/5) // 6/5
+					{
+						// printf("blocked! block_score2: %d block_score %d\n", block_score2, block_score);
+						block_score = 0;
+						break;
+					}
+				}
+			}
+
+			// greedy: use block when it scores better than literal
+			if (block_score <= literal_score)
+				block_len = 0;
+		}
+
+		if (stats) search_time += p8_time() - t0;
+
+		if (block_len >= PXA_MIN_BLOCK_LEN)
+		{
+			// block
+			//printf("*");
+
+
+			bits = get_write_pos(ctx);
+
+			// makes sense to mark with block because aim for ~ 50% blocks
+			putbit(ctx, 0);
+
+
+			// printf(" writing block offset:%d len:%d\n", block_offset, block_len);
+			
+			putnum(ctx, block_offset - 1);
+			putchain(ctx, block_len-PXA_MIN_BLOCK_LEN, BLOCK_LEN_CHAIN_BITS, 100000);
+
+			pos += block_len;
+			
+			if (stats)
+			{
+				stats->block_bits += get_write_pos(ctx) - bits;
+				stats->num_blocks ++;
+				stats->len_hist[pxa_log2(block_len)] ++;
+				stats->offset_hist[pxa_log2(block_offset)] ++;
+			}
+		}
+		else
+		{
+			// literal
+
+			bits = get_write_pos(ctx);
+			putbit(ctx, 1);
+
+			// write category
 
 			int cat_bits = TINY_LITERAL_BITS;
 			int cat_max_val = 1 << cat_bits;
@@ -592,27 +1344,24 @@ int pxa_compress(uint8 *in_p, uint8 *out, int len)
 				cat_max_val += (1 << cat_bits);
 			}
 
-			putchain(cat_bits - TINY_LITERAL_BITS, 1, 16); // 16: safety
+			putchain(ctx, cat_bits - TINY_LITERAL_BITS, 1, 16); // 16: safety
 			
 			// write the index itself
-			putval(val, cat_bits); // lpos
+			putval(ctx, val, cat_bits); // lpos
 		
-			// move c to start of vlist and update positions
+			// move c to start of vlist
 			// only pay attention to value outside of blocks; compression ratio is fine (maybe better?) and faster to calculate
 			
-			for (i = lpos; i > 0; i--)
-			{
-				literal[i] = literal[i-1];
-				literal_pos[literal[i]] ++;
-			}
-			literal[0] = c;
-			literal_pos[c] = 0;
+			literal_to_front(literal, lpos);
 
 			pos ++;
 			
-			// stats
-			
-			num_literals ++;
+			if (stats)
+			{
+				stats->literal_bits += get_write_pos(ctx) - bits;
+				stats->num_literals ++;
+			}
+
 			block_len = 1; // for writing hash
 		}
 
@@ -621,14 +1370,14 @@ int pxa_compress(uint8 *in_p, uint8 *out, int len)
 		for (i = MAX(0, pos - block_len-2); i < pos-2; i++)
 		{
 			hash = MINI_HASH(in, i);
-			found[hash] = i;
+			ctx->found[hash] = i;
 		}
 
 		// 0.2.0j: if last 32 bytes (or remaining end of input) written have a ratio worse than ~1.0, rewrite as a raw block instead
 
-		if (dest_pos - raw_pos_dest >= 32 || pos == len)
+		if (WRITE_BYTE_POS(ctx) - raw_pos_dest >= 32 || pos == len)
 		{
-			int compressed_size = dest_pos - raw_pos_dest;
+			int compressed_size = WRITE_BYTE_POS(ctx) - raw_pos_dest;
 			int raw_size = pos - raw_pos_src;
 			int margin = raw_pos_src0 == raw_pos_src ? 3 : 0; // 3 for first section (header + null terminator), 0 for appended
 
@@ -640,50 +1389,72 @@ int pxa_compress(uint8 *in_p, uint8 *out, int len)
 					// write header marker 010 00000 00000
 					raw_block_size = raw_size;
 					raw_header_write_pos = raw_block_write_pos;
-					set_write_pos(raw_header_write_pos);
-					putbit(0); putbit(1); putbit(0); putval(0, 10);
+					set_write_pos(ctx, raw_header_write_pos);
+					putbit(ctx, 0); putbit(ctx, 1); putbit(ctx, 0); putval(ctx, 0, 10);
 				}
 				else
 				{
 					// append
-					set_write_pos(raw_block_write_pos);
-					dest_pos--; // overwrite previous null terminator
+					set_write_pos(ctx, raw_block_write_pos - 8); // overwrite previous null terminator
 				}
 
 				// write raw data (not aligned)
-				int k = 0;
-				for (k = 0; k < raw_size; k++)
-					putval(in[raw_pos_src + k], 8);
-				putval(0,8); // null terminator
+				putbytes(ctx, &in[raw_pos_src], raw_size);
+				putval(ctx, 0, 8); // null terminator
 
 				stored_last_segment_as_raw = 1;
 				RESTORE_VLIST_STATE();
+
+				// replaces tokens since start of raw block: header, data so far, terminator
+				raw_rewrites ++;
+				if (stats)
+				{
+					*stats = stats_backup;
+					stats->raw_bits += 13 + (pos - raw_pos_src0) * 8 + 8;
+				}
 			}
 			else{
 				// leave as-is; reset start position of next possible raw block
 				stored_last_segment_as_raw = 0;
 				raw_pos_src0 = pos;
 				BACKUP_VLIST_STATE();
+				if (stats) stats_backup = *stats;
+
+				if (inc && !parse && pos < len)
+					pxa_add_checkpoint(inc, pos, get_write_pos(ctx), ctx->read_end, literal);
 			}
 
-			raw_pos_dest = dest_pos;
+			raw_pos_dest = WRITE_BYTE_POS(ctx);
 			raw_pos_src = pos;
-			raw_block_write_pos = get_write_pos();
+			raw_block_write_pos = get_write_pos(ctx);
 		}
 
 	}
 
-	codo_free(modified_code);
+	codo_free(parse);
 
 	// advance to next byte (and zero any junk)
-	while (bit != 1)
-		putbit(0); 
+	putval(ctx, 0, (8 - (ctx->put_count & 7)) & 7);
+	flush_bits(ctx);
 
-	int bytes_written = dest_pos;
+	int bytes_written = WRITE_BYTE_POS(ctx);
 	
-	dest_buf[6] = bytes_written / 256;
-	dest_buf[7] = bytes_written % 256;
+	if (dest)
+	{
+		dest[6] = bytes_written / 256;
+		dest[7] = bytes_written % 256;
+	}
 
+	if (inc) inc->bytes_written = bytes_written;
+
+	if (stats)
+	{
+		stats->raw_rewrites = raw_rewrites;
+		stats->stored_raw = bytes_written > len;
+		stats->hash_time = hash_time;
+		stats->search_time = search_time;
+		stats->emit_time = p8_time() - t_start - hash_time - search_time;
+	}
 
 	// 0.2.0e: compressed is larger than input -> just return input (same as pxc)
 	// for storing binary data -- perhaps cart is mostly data w/ tiny stub
@@ -692,120 +1463,782 @@ int pxa_compress(uint8 *in_p, uint8 *out, int len)
 	{
 		// 0.2.0j: fixed: was in (which now points to deallocated memory. discovered because oversized-cart get_cart_hash was failing!)
 		// would also cause small, or data-heavy .png file save/load to fail
-		memcpy(out, in_p, len); 
+		if (out) memcpy(out, in_p, len); 
 		return len;
 	}
 
+	if (dest != out)
+		memcpy(out, dest, bytes_written);
+
 	return bytes_written;
 }
 
+// returns compressed length, or -1 if len > CODE_MAX_LEN. stats: optional (NULL)
+// in_p: len bytes, read in place (no null terminator needed, not modified)
+int pxa_compress(pxa_context *ctx, uint8 *in_p, uint8 *out, int len, int level, pxa_stats *stats)
+{
+	return pxa_encode(ctx, in_p, out, out, len, level, stats, NULL);
+}
 
-int pxa_decompress(uint8 *in_p, uint8 *out_p, int max_len)
+// what pxa_compress would return (same decisions, raw block rewrites and raw fallback), without
+// storing any output. for size meters
+int pxa_compressed_size(pxa_context *ctx, uint8 *in_p, int len, int level)
 {
-	uint8 *dest;
-	int i;
-	int literal[256];
-	int literal_pos[256];
-	int dest_pos = 0;
+	return pxa_encode(ctx, in_p, NULL, NULL, len, level, NULL, NULL);
+}
 
-	bit = 1;
-	byte = 0;
-	src_buf = in_p;
-	src_pos = 0;
+pxa_incremental *pxa_create_incremental()
+{
+	pxa_incremental *inc = codo_malloc(sizeof(pxa_incremental));
+	memset(inc, 0, sizeof(pxa_incremental));
+	return inc;
+}
 
-	init_literals_state(literal, literal_pos);
+void pxa_free_incremental(pxa_incremental *inc)
+{
+	if (!inc) return;
+	codo_free(inc->in);
+	codo_free(inc->out);
+	codo_free(inc->checkpoint);
+	codo_free(inc);
+}
 
-	// header
+// same output as pxa_compress, for repeated compression of an edited cart (editor saves).
+// keeps a copy of input and output, and resumes from the last checkpoint that no later input
+// change can affect, so time depends on distance from first changed byte to end.
+// PXA_LEVEL_MAX always compresses everything.
+// out NULL: only return size, as pxa_compressed_size (for size meters; output isn't kept either)
+int pxa_compress_incremental(pxa_context *ctx, pxa_incremental *inc, uint8 *in_p, uint8 *out, int len, int level)
+{
+	int d = 0, n;
+	uint8 *buf;
+	int count_only = out == NULL;
 
-	int header[8];
-	for (i = 0; i < 8; i++)
-		header[i] = PXA_READ_VAL();
+	if (len > CODE_MAX_LEN) return -1;
 
-	int raw_len  = header[4] * 256 + header[5];
-	int comp_len = header[6] * 256 + header[7];
+	pxa_set_level(ctx, level);
 
-	// printf(" read raw_len:  %d\n", raw_len);
-	// printf(" read comp_len: %d\n", comp_len);
+	if (level != inc->level || ctx->max_chain != inc->max_chain || ctx->nice_len != inc->nice_len ||
+		(inc->count_only && !count_only))
+		inc->num_checkpoints = 0;
 
-	while (src_pos < comp_len && dest_pos < raw_len && dest_pos < max_len)
+	// first changed byte. checkpoints after decisions that looked at it (or past it) are stale
+	n = MIN(len, inc->in_len);
+	while (d < n && in_p[d] == inc->in[d])
+		d++;
+
+	if (d == len && len == inc->in_len && inc->num_checkpoints > 0)
 	{
-		int block_type = getbit();
+		// unchanged
+		if (inc->bytes_written > len) { if (out) memcpy(out, in_p, len); return len; }
+		if (out) memcpy(out, inc->out, inc->bytes_written);
+		return inc->bytes_written;
+	}
 
-		// printf("%d %d\n", src_pos, block_type); fflush(stdout);
+	while (inc->num_checkpoints > 0 && inc->checkpoint[inc->num_checkpoints - 1].read_end > d)
+		inc->num_checkpoints --;
 
-		if (block_type == 0)
-		{
-			// block
+	if (len > inc->in_size)
+	{
+		codo_free(inc->in);
+		inc->in = codo_malloc(len);
+		inc->in_size = len;
+	}
+	memcpy(inc->in, in_p, len);
+	inc->in_len = len;
 
-			int block_offset = getnum() + 1;
+	// output before raw fallback: at most ~2 bytes per input byte between raw block checks
+	if (len * 2 + 256 > inc->out_size)
+	{
+		buf = codo_malloc(len * 2 + 256);
+		if (inc->out) memcpy(buf, inc->out, inc->out_size);
+		codo_free(inc->out);
+		inc->out = buf;
+		inc->out_size = len * 2 + 256;
+	}
 
-			if (block_offset == 0)
-			{
-				// 0.2.0j: raw block
-				while (dest_pos < raw_len)
-				{
-					out_p[dest_pos] = getval(8);
-					if (out_p[dest_pos] == 0) // found end -- don't advance dest_pos
-						break;
-					dest_pos ++;
-				}
-			}
-			else
-			{
-				int block_len = getchain(BLOCK_LEN_CHAIN_BITS, 100000) + PXA_MIN_BLOCK_LEN;
+	inc->level = level;
+	inc->max_chain = ctx->max_chain;
+	inc->nice_len = ctx->nice_len;
+	inc->count_only = count_only;
 
-				// copy // don't just memcpy because might be copying self for repeating pattern
-				while (block_len > 0){
-					out_p[dest_pos] = out_p[dest_pos - block_offset];
-					dest_pos++;
-					block_len--;
+	return pxa_encode(ctx, in_p, count_only ? NULL : inc->out, out, len, level, NULL, inc);
+}
+
+
+// copy len bytes from offset bytes back. overlaps (offset < len) repeat the pattern
+static void copy_block(uint8 *dest, int offset, int len)
+{
+	uint8 *src = dest - offset;
+	uint8 *end = dest + len;
+
+	if (offset >= len)
+	{
+		memcpy(dest, src, len);
+		return;
+	}
+
+	if (offset < 8)
+	{
+		// pattern also repeats every (multiple of offset) bytes: widen to >= 8 so that 8-byte
+		// copies never read bytes they write. first write the bytes that aren't yet that far back.
+		int wide = offset;
+		int head;
+
+		while (wide < 8)
+			wide += offset;
+
+		head = MIN(len, wide - offset);
+		while (head-- > 0)
+			*dest++ = *src++;
+
+		src = dest - wide;
+		offset = wide;
+	}
+
+	if (offset >= 16)
+		for (; end - dest >= 16; dest += 16, src += 16)
+			memcpy(dest, src, 16);
+
+	for (; end - dest >= 8; dest += 8, src += 8)
+		memcpy(dest, src, 8);
+
+	while (dest < end)
+		*dest++ = *src++;
+}
+
+int pxa_decompress(pxa_context *ctx, uint8 *in_p, uint8 *out_p, int max_len)
+{
+	uint8 *dest;
+	int i;
+	uint8 literal[256];
+	int dest_pos = 0;
+
+	init_literals_state(literal);
+
+	// header
+
+	int raw_len  = in_p[4] * 256 + in_p[5];
+	int comp_len = in_p[6] * 256 + in_p[7];
+
+	// printf(" read raw_len:  %d\n", raw_len);
+	// printf(" read comp_len: %d\n", comp_len);
+
+	init_bit_reader(ctx, in_p, 8, comp_len);
+
+	while (get_read_pos(ctx) < comp_len && dest_pos < raw_len && dest_pos < max_len)
+	{
+		refill_bits(ctx);
+
+		int block_type = PEEK_BITS(ctx, 1);
+		SKIP_BITS(ctx, 1);
+
+		// printf("%d %d\n", get_read_pos(ctx), block_type); fflush(stdout);
+
+		if (block_type == 0)
+		{
+			// block
+
+			int block_offset = getnum(ctx) + 1;
+
+			if (block_offset == 0)
+			{
+				// 0.2.0j: raw block
+				while (dest_pos < raw_len)
+				{
+					out_p[dest_pos] = getbits(ctx, 8);
+					if (out_p[dest_pos] == 0) // found end -- don't advance dest_pos
+						break;
+					dest_pos ++;
 				}
+			}
+			else
+			{
+				int block_len = getlenchain(ctx) + PXA_MIN_BLOCK_LEN;
 
-				// safety: null terminator. to do: just do at end
-				if (dest_pos < max_len-1)
-					out_p[dest_pos] = 0;
+				// copy // don't just memcpy because might be copying self for repeating pattern
+				copy_block(&out_p[dest_pos], block_offset, block_len);
+				dest_pos += block_len;
 			}
 		}else
 		{
 			// literal
 
-			int lpos = 0;
-			int bits = 0;
+			// category: n 1s then 0. each 1 skips past (1 << (TINY_LITERAL_BITS + i)) values
+			// still have >= 56 bits from refill above: enough for prefix + index (max 13)
 
-			int safety = 0;
-			while (getbit() == 1 && safety++ < 16)
-			{
-				lpos += (1 << (TINY_LITERAL_BITS + bits));
-				bits ++;
-			}
+			int n = ctx->literal_cat[PEEK_BITS(ctx, 8)];
+			if (n > 4) break; // something wrong (lpos > 255)
+			SKIP_BITS(ctx, n + 1);
 
-			bits += TINY_LITERAL_BITS;
-			lpos += getval(bits);
+			int bits = TINY_LITERAL_BITS + n;
+			int lpos = (1 << bits) - (1 << TINY_LITERAL_BITS);
+			lpos += PEEK_BITS(ctx, bits);
+			SKIP_BITS(ctx, bits);
 
-			if (lpos > 255) return 0; // something wrong
+			if (lpos > 255) break; // something wrong
 
 			// grab character and write
 			int c = literal[lpos];
 
 			out_p[dest_pos] = c;
 			dest_pos++;
-			out_p[dest_pos] = 0;
 			
-			int i;
-			for (i = lpos; i > 0; i--)
+			literal_to_front(literal, lpos);
+		}
+	}
+
+	// null terminator (once, instead of after every block and literal)
+	if (dest_pos <= max_len)
+		out_p[dest_pos] = 0;
+
+	return 0;
+}
+
+// for untrusted data (user uploads): same as pxa_decompress, but never reads past in_len
+// or writes past raw_len (<= max_len). checked once per token, not per byte (except for
+// raw blocks, which end at a 0 byte). out_p should allocate max_len+1
+// returns decompressed length, or -1 for corrupt / truncated data
+int pxa_decompress_safe(pxa_context *ctx, uint8 *in_p, int in_len, uint8 *out_p, int max_len)
+{
+	uint8 literal[256];
+	int dest_pos = 0;
+	int raw_len, comp_len;
+
+	if (in_len < 8 || memcmp(in_p, "\0pxa", 4)) return -1;
+
+	raw_len  = in_p[4] * 256 + in_p[5];
+	comp_len = in_p[6] * 256 + in_p[7];
+
+	if (raw_len > max_len || comp_len > in_len) return -1;
+
+	init_literals_state(literal);
+
+	// reads 0s past comp_len, so bit reads within a token don't need checking
+	init_bit_reader(ctx, in_p, 8, comp_len);
+
+	while (get_read_pos(ctx) < comp_len && dest_pos < raw_len)
+	{
+		refill_bits(ctx);
+
+		int block_type = PEEK_BITS(ctx, 1);
+		SKIP_BITS(ctx, 1);
+
+		if (block_type == 0)
+		{
+			int block_offset = getnum(ctx) + 1;
+
+			if (block_offset == 0)
+			{
+				// raw block: ends at 0 (also found past comp_len) or raw_len
+				while (dest_pos < raw_len)
+				{
+					int val = getbits(ctx, 8);
+					if (val == 0) break;
+					out_p[dest_pos++] = val;
+				}
+			}
+			else
 			{
-				literal[i] = literal[i-1];
-				literal_pos[literal[i]] ++;
+				int block_len = getlenchain(ctx) + PXA_MIN_BLOCK_LEN;
+
+				if (block_offset > dest_pos || block_len > raw_len - dest_pos)
+					return -1;
+
+				copy_block(&out_p[dest_pos], block_offset, block_len);
+				dest_pos += block_len;
 			}
-			literal[0] = c;
-			literal_pos[c] = 0;
 		}
+		else
+		{
+			int n = ctx->literal_cat[PEEK_BITS(ctx, 8)];
+			if (n > 4) return -1;
+			SKIP_BITS(ctx, n + 1);
+
+			int bits = TINY_LITERAL_BITS + n;
+			int lpos = (1 << bits) - (1 << TINY_LITERAL_BITS);
+			lpos += PEEK_BITS(ctx, bits);
+			SKIP_BITS(ctx, bits);
+
+			if (lpos > 255) return -1;
+
+			out_p[dest_pos++] = literal[lpos];
+			literal_to_front(literal, lpos);
+		}
+	}
+
+	if (dest_pos < raw_len) return -1; // ran out of data
+
+	out_p[dest_pos] = 0;
+
+	return dest_pos;
+}
+
+
+//-------------------------------------------------
+// pxa random access
+//
+// side-car index of decoder state (bit position, output position, literal list) at the
+// first token boundary every interval output bytes. pxa_decompress_range decodes only the
+// segments between checkpoints that hold the range, plus as much of earlier segments as
+// its block copies read from (found as needed; each byte is decoded at most once).
+//-------------------------------------------------
+
+#define PXA_INDEX_MIN_INTERVAL 256 // bounds recursion depth of pxa_decode_segment
+
+typedef struct
+{
+	int bit_pos;
+	int dest_pos;
+	uint8 literal[256];
+} pxa_index_entry;
+
+// one allocation with no pointers: can be stored next to the cart as is (pxa_index_size bytes)
+struct pxa_index
+{
+	int raw_len, comp_len;
+	int num;
+	pxa_index_entry entry[];
+};
+
+// range decode: how far each segment has been decoded, and decoder state to continue it
+typedef struct
+{
+	int dest_pos;       // decoded up to here
+	int src_pos, bit_count;
+	uint64 bit_buf;
+	uint8 literal[256];
+} pxa_range_segment;
+
+typedef struct
+{
+	pxa_index *index;
+	uint8 *in_p, *out;
+	pxa_range_segment *seg;
+} pxa_range;
+
+// one token at dest_pos. literals and raw blocks are written; blocks are only read (*block_offset,
+// returned length), so that caller can copy once the source is available.
+// returns bytes of output, or -1 for end of data / corrupt
+static int pxa_read_token(pxa_context *ctx, uint8 *out_p, int dest_pos, int raw_len, uint8 *literal, int *block_offset)
+{
+	int n = 0;
+
+	*block_offset = 0;
+	refill_bits(ctx);
+
+	if (PEEK_BITS(ctx, 1) == 0)
+	{
+		SKIP_BITS(ctx, 1);
+		*block_offset = getnum(ctx) + 1;
+
+		if (*block_offset > 0)
+			return getlenchain(ctx) + PXA_MIN_BLOCK_LEN;
+
+		// raw block
+		while (dest_pos + n < raw_len)
+		{
+			int val = getbits(ctx, 8);
+			if (val == 0) break;
+			out_p[dest_pos + n++] = val;
+		}
+		return n;
+	}
+
+	SKIP_BITS(ctx, 1);
+	n = ctx->literal_cat[PEEK_BITS(ctx, 8)];
+	if (n > 4) return -1;
+	SKIP_BITS(ctx, n + 1);
+
+	int bits = TINY_LITERAL_BITS + n;
+	int lpos = (1 << bits) - (1 << TINY_LITERAL_BITS) + PEEK_BITS(ctx, bits);
+	SKIP_BITS(ctx, bits);
+
+	if (lpos > 255) return -1;
+
+	out_p[dest_pos] = literal[lpos];
+	literal_to_front(literal, lpos);
+	return 1;
+}
+
+// decode compressed in_p once, recording a checkpoint at the first token at or after every
+// interval bytes of output. returns NULL for corrupt data. free with codo_free
+pxa_index *pxa_build_index(pxa_context *ctx, uint8 *in_p, int in_len, int interval)
+{
+	pxa_index *index;
+	uint8 literal[256];
+	uint8 *out;
+	int raw_len, comp_len, dest_pos = 0, n, block_offset, max_num;
+
+	if (in_len < 8 || memcmp(in_p, "\0pxa", 4)) return NULL;
+
+	raw_len  = in_p[4] * 256 + in_p[5];
+	comp_len = in_p[6] * 256 + in_p[7];
+	if (comp_len > in_len) return NULL;
+
+	interval = MAX(interval, PXA_INDEX_MIN_INTERVAL);
+	max_num = raw_len / interval + 1;
+	index = codo_malloc(sizeof(pxa_index) + max_num * sizeof(pxa_index_entry));
+	index->raw_len = raw_len;
+	index->comp_len = comp_len;
+	index->num = 0;
+
+	out = codo_malloc(raw_len + 1);
+	init_literals_state(literal);
+	init_bit_reader(ctx, in_p, 8, comp_len);
+
+	while (dest_pos < raw_len)
+	{
+		if (dest_pos >= index->num * interval && index->num < max_num)
+		{
+			pxa_index_entry *e = &index->entry[index->num++];
+			e->bit_pos = ctx->src_pos * 8 - ctx->bit_count;
+			e->dest_pos = dest_pos;
+			memcpy(e->literal, literal, 256);
+		}
+
+		if (get_read_pos(ctx) >= comp_len) break;
+		n = pxa_read_token(ctx, out, dest_pos, raw_len, literal, &block_offset);
+		if (n < 0 || (block_offset > 0 && (block_offset > dest_pos || n > raw_len - dest_pos))) break;
+
+		if (block_offset > 0)
+			copy_block(&out[dest_pos], block_offset, n);
+		dest_pos += n;
 	}
 
+	codo_free(out);
+
+	if (dest_pos < raw_len)
+	{
+		codo_free(index);
+		return NULL;
+	}
 
+	return index;
+}
+
+int pxa_index_size(pxa_index *index)
+{
+	return sizeof(pxa_index) + index->num * sizeof(pxa_index_entry);
+}
+
+// segment containing output position (entries are in order of dest_pos)
+static int pxa_index_segment(pxa_index *index, int pos)
+{
+	int lo = 0, hi = index->num - 1;
+
+	while (lo < hi)
+	{
+		int mid = (lo + hi + 1) >> 1;
+		if (index->entry[mid].dest_pos <= pos)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+
+	return lo;
+}
+
+// decode segment seg up to (at least) output position upto, continuing from where it got to
+static int pxa_decode_segment(pxa_context *ctx, pxa_range *r, int seg, int upto)
+{
+	pxa_index *index = r->index;
+	pxa_range_segment *rs = &r->seg[seg];
+	int start = index->entry[seg].dest_pos;
+	int end = seg + 1 < index->num ? index->entry[seg + 1].dest_pos : index->raw_len;
+	int n, block_offset, src, k;
+
+	upto = MIN(upto, end);
+	if (rs->dest_pos >= upto) return 0;
+
+	if (rs->dest_pos < 0)
+	{
+		// start from checkpoint
+		pxa_index_entry *e = &index->entry[seg];
+		init_bit_reader(ctx, r->in_p, e->bit_pos >> 3, index->comp_len);
+		refill_bits(ctx);
+		SKIP_BITS(ctx, e->bit_pos & 7);
+		rs->dest_pos = start;
+		memcpy(rs->literal, e->literal, 256);
+	}
+	else
+	{
+		init_bit_reader(ctx, r->in_p, rs->src_pos, index->comp_len);
+		ctx->bit_buf = rs->bit_buf;
+		ctx->bit_count = rs->bit_count;
+	}
+
+	while (rs->dest_pos < upto)
+	{
+		n = pxa_read_token(ctx, r->out, rs->dest_pos, index->raw_len, rs->literal, &block_offset);
+		if (n < 0) return -1;
+
+		if (block_offset > 0)
+		{
+			src = rs->dest_pos - block_offset;
+			if (src < 0 || n > index->raw_len - rs->dest_pos) return -1;
+
+			// source in earlier segments: decode that much of them first (reader is theirs meanwhile)
+			if (src < start)
+			{
+				rs->src_pos = ctx->src_pos; rs->bit_buf = ctx->bit_buf; rs->bit_count = ctx->bit_count;
+
+				for (k = pxa_index_segment(index, src); k < seg && index->entry[k].dest_pos < src + n; k++)
+					if (pxa_decode_segment(ctx, r, k, src + n) < 0)
+						return -1;
+
+				init_bit_reader(ctx, r->in_p, rs->src_pos, index->comp_len);
+				ctx->bit_buf = rs->bit_buf;
+				ctx->bit_count = rs->bit_count;
+			}
+
+			copy_block(&r->out[rs->dest_pos], block_offset, n);
+		}
+
+		rs->dest_pos += n;
+	}
+
+	rs->src_pos = ctx->src_pos; rs->bit_buf = ctx->bit_buf; rs->bit_count = ctx->bit_count;
 	return 0;
 }
 
+// decompress out_len bytes of output starting at start into out (not null terminated), using an
+// index from pxa_build_index for the same data. returns bytes written, or -1 for corrupt data
+int pxa_decompress_range(pxa_context *ctx, uint8 *in_p, pxa_index *index, int start, uint8 *out, int out_len)
+{
+	pxa_range r;
+	int seg, last, result = 0;
+
+	start = MAX(start, 0);
+	out_len = MIN(out_len, index->raw_len - start);
+	if (out_len <= 0 || index->num == 0) return 0;
+
+	r.index = index;
+	r.in_p = in_p;
+	r.out = codo_malloc(index->raw_len);
+	r.seg = codo_malloc(index->num * sizeof(pxa_range_segment));
+
+	for (seg = 0; seg < index->num; seg++)
+		r.seg[seg].dest_pos = -1; // not started
+
+	last = pxa_index_segment(index, start + out_len - 1);
+	for (seg = pxa_index_segment(index, start); seg <= last && result == 0; seg++)
+		result = pxa_decode_segment(ctx, &r, seg, start + out_len);
+
+	if (result == 0)
+	{
+		memcpy(out, r.out + start, out_len);
+		result = out_len;
+	}
+
+	codo_free(r.out);
+	codo_free(r.seg);
+
+	return result;
+}
+
+
+//-------------------------------------------------
+// pxa streaming decoder
+//-------------------------------------------------
+
+/*
+	pull-style: caller points next_in / avail_in at whatever compressed bytes have arrived
+	and next_out / avail_out at free space, then calls pxa_decompress_stream() until it
+	returns CODE_STREAM_END. both are advanced past what was used. can stop and resume
+	at any byte (or bit) -- partly read tokens and unfinished block copies are kept.
+
+	only the last 32k of output is kept for block copies (max offset is 32768), so each
+	stream costs ~33k no matter how large the output buffer is.
+
+	unlike pxa_decompress(), no null terminator is written, and corrupt data is reported.
+*/
+
+#define PXA_PHASE_HEADER 0
+#define PXA_PHASE_TOKEN  1
+#define PXA_PHASE_LENGTH 2
+#define PXA_PHASE_COPY   3
+#define PXA_PHASE_RAW    4
+#define PXA_PHASE_DONE   5
+
+void pxa_stream_init(pxa_stream *s)
+{
+	memset(s, 0, sizeof(pxa_stream));
+	init_literals_state(s->literal);
+	s->phase = PXA_PHASE_HEADER;
+}
+
+// top up bit_buf from next_in. past comp_len, reads zeros (like refill_bits)
+// returns 1 if at least bits are buffered
+static int stream_need_bits(pxa_stream *s, int bits)
+{
+	while (s->bit_count <= 56)
+	{
+		uint64 b = 0;
+
+		if (s->in_pos < s->comp_len)
+		{
+			if (s->avail_in == 0) break;
+			b = *s->next_in++;
+			s->avail_in --;
+		}
+
+		s->bit_buf |= b << s->bit_count;
+		s->bit_count += 8;
+		s->in_pos ++;
+	}
+
+	return s->bit_count >= bits;
+}
+
+static void stream_put(pxa_stream *s, int c)
+{
+	s->hist[s->dest_pos & (PXA_STREAM_HIST-1)] = c;
+	*s->next_out++ = c;
+	s->avail_out --;
+	s->dest_pos ++;
+}
+
+int pxa_decompress_stream(pxa_stream *s)
+{
+	while (1)
+	{
+		switch (s->phase)
+		{
+		case PXA_PHASE_HEADER:
+
+			while (s->in_pos < 8)
+			{
+				int val;
+
+				if (s->avail_in == 0) return CODE_STREAM_INPUT;
+				val = *s->next_in++;
+				s->avail_in --;
+
+				if (s->in_pos < 4 && val != "\0pxa"[s->in_pos]) return CODE_STREAM_ERROR;
+				if (s->in_pos == 4 || s->in_pos == 5) s->raw_len  = s->raw_len  * 256 + val;
+				if (s->in_pos == 6 || s->in_pos == 7) s->comp_len = s->comp_len * 256 + val;
+				s->in_pos ++;
+			}
+
+			s->phase = PXA_PHASE_TOKEN;
+			break;
+
+		case PXA_PHASE_TOKEN:
+		{
+			int n, bits, lpos;
+
+			// same end condition as pxa_decompress (read position is byte holding next unread bit)
+			if (((s->in_pos * 8 - s->bit_count) >> 3) >= s->comp_len || s->dest_pos >= s->raw_len)
+			{
+				s->phase = PXA_PHASE_DONE;
+				break;
+			}
+
+			// longest token start: 1 + 17 (block offset)
+			if (!stream_need_bits(s, 18)) return CODE_STREAM_INPUT;
+			if (s->avail_out == 0) return CODE_STREAM_OUTPUT;
+
+			if (PEEK_BITS(s, 1) == 0)
+			{
+				// block
+				int prefix;
+
+				SKIP_BITS(s, 1);
+				prefix = PEEK_BITS(s, 2);
+				SKIP_BITS(s, num_prefix_bits[prefix]);
+				bits = num_bits[prefix];
+				s->block_offset = PEEK_BITS(s, bits) + 1;
+				SKIP_BITS(s, bits);
+
+				if (s->block_offset == 1 && bits == 10)
+				{
+					s->phase = PXA_PHASE_RAW;
+					break;
+				}
+
+				if (s->block_offset > s->dest_pos) return CODE_STREAM_ERROR; // before start of output
+
+				s->block_len = PXA_MIN_BLOCK_LEN;
+				s->phase = PXA_PHASE_LENGTH;
+				break;
+			}
+
+			// literal (see pxa_decompress)
+			SKIP_BITS(s, 1);
+			for (n = 0; n < 5 && (s->bit_buf >> n) & 1; n++)
+				;
+			if (n > 4) return CODE_STREAM_ERROR;
+			SKIP_BITS(s, n + 1);
+
+			bits = TINY_LITERAL_BITS + n;
+			lpos = (1 << bits) - (1 << TINY_LITERAL_BITS) + PEEK_BITS(s, bits);
+			SKIP_BITS(s, bits);
+
+			if (lpos > 255) return CODE_STREAM_ERROR;
+
+			stream_put(s, s->literal[lpos]);
+			literal_to_front(s->literal, lpos);
+			break;
+		}
+
+		case PXA_PHASE_LENGTH:
+
+			// one link at a time: chain can be split across calls
+			while (1)
+			{
+				int link;
+
+				if (!stream_need_bits(s, BLOCK_LEN_CHAIN_BITS)) return CODE_STREAM_INPUT;
+				link = PEEK_BITS(s, BLOCK_LEN_CHAIN_BITS);
+				SKIP_BITS(s, BLOCK_LEN_CHAIN_BITS);
+				s->block_len += link;
+				if (link != (1 << BLOCK_LEN_CHAIN_BITS) - 1) break;
+			}
+
+			// pxa_decompress writes past raw_len here; stream output stops at raw_len
+			s->block_len = MIN(s->block_len, s->raw_len - s->dest_pos);
+			s->phase = PXA_PHASE_COPY;
+			break;
+
+		case PXA_PHASE_COPY:
+
+			// byte at a time: offset can be less than len (repeating pattern)
+			while (s->block_len > 0)
+			{
+				if (s->avail_out == 0) return CODE_STREAM_OUTPUT;
+				stream_put(s, s->hist[(s->dest_pos - s->block_offset) & (PXA_STREAM_HIST-1)]);
+				s->block_len --;
+			}
+
+			s->phase = PXA_PHASE_TOKEN;
+			break;
+
+		case PXA_PHASE_RAW:
+
+			// 0.2.0j: raw bytes until 0
+			while (s->dest_pos < s->raw_len)
+			{
+				int val;
+
+				if (!stream_need_bits(s, 8)) return CODE_STREAM_INPUT;
+				val = PEEK_BITS(s, 8);
+				if (val != 0 && s->avail_out == 0) return CODE_STREAM_OUTPUT;
+				SKIP_BITS(s, 8);
+
+				if (val == 0) break;
+				stream_put(s, val);
+			}
+
+			s->phase = PXA_PHASE_TOKEN;
+			break;
+
+		default:
+			return CODE_STREAM_END;
+		}
+	}
+}
+
 int is_compressed_format_header(uint8 *dat)
 {
 	if (dat[0] == ':' && dat[1] == 'c' && dat[2] == ':' && dat[3] == 0) return 1;
@@ -815,14 +2248,172 @@ int is_compressed_format_header(uint8 *dat)
 
 // max_len should be 0x10000 (64k max code size)
 // out_p should allocate 0x10001 (includes null terminator)
-int pico8_code_section_decompress(uint8 *in_p, uint8 *out_p, int max_len)
+int pico8_code_section_decompress(pxa_context *ctx, uint8 *in_p, uint8 *out_p, int max_len)
 {
 	if (is_compressed_format_header(in_p) == 0) { memcpy(out_p, in_p, 0x3d00); out_p[0x3d00] = '\0'; return 0; } // legacy: no header -> is raw text
 	if (is_compressed_format_header(in_p) == 1) return decompress_mini(in_p, out_p, max_len);
-	if (is_compressed_format_header(in_p) == 2) return pxa_decompress (in_p, out_p, max_len);
+	if (is_compressed_format_header(in_p) == 2) return pxa_decompress (ctx, in_p, out_p, max_len);
 	return 0;
 }
 
 
 
 
+
+// untrusted data: in_len bytes at in_p, out_p allocates max_len+1
+// returns decompressed length, or -1 for corrupt data
+int pico8_code_section_decompress_safe(pxa_context *ctx, uint8 *in_p, int in_len, uint8 *out_p, int max_len)
+{
+	int len;
+
+	if (in_len < 4 || is_compressed_format_header(in_p) == 0)
+	{
+		// legacy raw text: up to first null (rest of section is padding)
+		uint8 *end;
+		len = MIN(MIN(in_len, CODE_SECTION_SIZE), max_len);
+		if (len > 0 && (end = memchr(in_p, 0, len)))
+			len = end - in_p;
+		memcpy(out_p, in_p, len);
+		out_p[len] = '\0';
+		return len;
+	}
+
+	if (is_compressed_format_header(in_p) == 1) return decompress_mini_safe(in_p, in_len, out_p, max_len);
+	return pxa_decompress_safe(ctx, in_p, in_len, out_p, max_len);
+}
+
+
+
+// unified compressor (both formats)
+
+#define CODE_COMPRESS_BUF 0x30000 // encoder output before checking size (worst case is larger than input)
+
+typedef struct
+{
+	mini_context *ctx;
+	uint8 *in, *out;
+	int len, out_len;
+} mini_job;
+
+static void *run_mini_job(void *arg)
+{
+	mini_job *job = arg;
+	job->out_len = compress_mini(job->ctx, job->in, job->out, job->len, NULL);
+	return NULL;
+}
+
+// compressed size if the encoder wrote its format and it fits in the code section, else -1
+// (encoders return the input unchanged when compressing doesn't help)
+static int code_section_fit(uint8 *dat, int len)
+{
+	if (len < 8 || len > CODE_SECTION_SIZE || !is_compressed_format_header(dat)) return -1;
+	return len;
+}
+
+// compress code section with whichever of :c: and pxa is smaller. :c: is kept on a tie, as it
+// can also be read by pre-0.2.0 versions. when neither fits, store as raw text if that fits.
+// with PXA_THREADS, :c: runs on a second thread while pxa runs on this one.
+// in_p: len bytes (no null terminator needed)
+// out: CODE_SECTION_SIZE bytes (raw text is zero-padded)
+// returns bytes written, or -1 if nothing fits (or len > CODE_MAX_LEN). *format (optional): as
+// is_compressed_format_header
+int pico8_code_section_compress(pxa_context *ctx, uint8 *in_p, uint8 *out, int len, int level, int *format)
+{
+	mini_job job;
+	uint8 *pxa_out;
+	int mini_len, pxa_len, result = -1, fmt = 0;
+#ifdef PXA_THREADS
+	pthread_t thread;
+	int threaded;
+#endif
+
+	if (format) *format = 0;
+	if (len > CODE_MAX_LEN) return -1;
+
+	pxa_out = codo_malloc(CODE_COMPRESS_BUF);
+
+	job.ctx = pxa_mini_context(ctx); // before the thread starts: pxa_compress doesn't touch it
+	job.in = in_p;
+	job.out = codo_malloc(CODE_COMPRESS_BUF);
+	job.len = len;
+
+#ifdef PXA_THREADS
+	threaded = pthread_create(&thread, NULL, run_mini_job, &job) == 0;
+	if (!threaded) run_mini_job(&job);
+	pxa_len = pxa_compress(ctx, in_p, pxa_out, len, level, NULL);
+	if (threaded) pthread_join(thread, NULL);
+#else
+	run_mini_job(&job);
+	pxa_len = pxa_compress(ctx, in_p, pxa_out, len, level, NULL);
+#endif
+
+	mini_len = code_section_fit(job.out, job.out_len);
+	pxa_len = code_section_fit(pxa_out, pxa_len);
+
+	if (mini_len >= 0 && (pxa_len < 0 || mini_len <= pxa_len))
+	{
+		memcpy(out, job.out, mini_len);
+		result = mini_len; fmt = 1;
+	}
+	else if (pxa_len >= 0)
+	{
+		memcpy(out, pxa_out, pxa_len);
+		result = pxa_len; fmt = 2;
+	}
+	else if (len <= CODE_SECTION_SIZE && (len < 4 || !is_compressed_format_header(in_p)))
+	{
+		// legacy raw text (decoders read up to CODE_SECTION_SIZE bytes)
+		memset(out, 0, CODE_SECTION_SIZE);
+		memcpy(out, in_p, len);
+		result = len; fmt = 0;
+	}
+
+	codo_free(job.out);
+	codo_free(pxa_out);
+
+	if (format) *format = fmt;
+	return result;
+}
+
+
+#ifdef PXA_FUZZ
+
+// libFuzzer target:
+//   clang -g -O1 -fsanitize=fuzzer,address -DPXA_FUZZ pxa_compress_snippets.c p8_compress.c
+// runs pxa_decompress_safe and the streaming decoder (in small pieces) on the same input.
+// when the checked decoder accepts data, the stream must give exactly the same output.
+
+int LLVMFuzzerTestOneInput(const uint8 *data, size_t size)
+{
+	static pxa_context *ctx;
+	static pxa_stream s;
+	static uint8 out[0x10001];
+	static uint8 out2[0x10000];
+	uint8 *in;
+	int len, result;
+
+	if (!ctx) ctx = pxa_create_context();
+
+	// copy so that reads past size are caught
+	in = codo_malloc(MAX(size, 1));
+	memcpy(in, data, size);
+
+	len = pxa_decompress_safe(ctx, in, size, out, 0x10000);
+
+	pxa_stream_init(&s);
+	s.next_in = in;
+	s.next_out = out2;
+	s.avail_out = sizeof(out2);
+	do {
+		s.avail_in = MIN(7, (int)size - (int)(s.next_in - in));
+		result = pxa_decompress_stream(&s);
+	} while (result == CODE_STREAM_INPUT && s.avail_in == 0 && s.next_in < in + size);
+
+	if (len >= 0 && (result != CODE_STREAM_END || s.next_out - out2 != len || memcmp(out, out2, len)))
+		abort();
+
+	codo_free(in);
+	return 0;
+}
+
+#endif